@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <phosg/Time.hh>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Complex.hh"
+#include "DoubleDouble.hh"
+#include "Iterate.hh"
+#include "JuliaSet.hh"
+#include "Polynomial.hh"
+#include "Roots.hh"
+
+using namespace std;
+
+
+// Measures the speed of each iteration kernel on some fixed scenes, and checks
+// that each kernel's results match the scalar kernel's. The kernels are timed
+// alone (one thread calling root_batch on each row, as FractalFrame does) and
+// as part of a full render with different numbers of threads. Then it checks
+// mixed-precision rendering against double precision with the fastest kernel:
+// every pixel must reach the same root, with depths within 1. Exits with
+// status 1 if any kernel's results don't match.
+
+struct Scene {
+  const char* name;
+  vector<complex> coeffs;
+  size_t w, h;
+  double xmin, xmax, ymin, ymax;
+  size_t max_iterations = 100;
+};
+
+static const vector<Scene> scenes({
+  // the default window, with large basins
+  {"cubic", {{1, 0}, {0, 0}, {0, 0}, {-1, 0}}, 800, 600, -4.0, 4.0, -3.0, 3.0},
+  {"quintic", {{1, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, -1}}, 800, 600,
+      -2.0, 2.0, -1.5, 1.5},
+  // mixed coefficients, so the roots aren't symmetric
+  {"degree8", {{1, 0}, {0, 0}, {0, 0.5}, {0, 0}, {-1, 0}, {0, 0}, {0, 0},
+      {1, 0}, {-1, 1}}, 640, 480, -2.0, 2.0, -1.5, 1.5},
+  {"degree16", {{1, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+      {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-1, 0}},
+      512, 512, -1.5, 1.5, -1.5, 1.5},
+  // z^3 - 2z + 2 has an attracting cycle near 0, so most of this window never
+  // converges and runs for max_iterations
+  {"cycle", {{1, 0}, {0, 0}, {-2, 0}, {2, 0}}, 640, 480, -0.2, 0.2, -0.15, 0.15},
+  // a small window around -2^(-1/3), which Newton's method sends to 0 and then
+  // to infinity, so all three basins meet there many times
+  {"zoom", {{1, 0}, {0, 0}, {0, 0}, {-1, 0}}, 800, 600, -0.8037, -0.7837,
+      -0.0075, 0.0075},
+  {"hires", {{1, 0}, {0, 0}, {0, 0}, {0, 0}, {-1, 0}}, 1920, 1080, -2.0, 2.0,
+      -1.125, 1.125},
+  // the same point as zoom, but a window so small that it needs double-double
+  // precision. points this close to it go very far from the roots before
+  // coming back, so they take more iterations
+  {"deep", {{1, 0}, {0, 0}, {0, 0}, {-1, 0}}, 320, 240, -0.79370052598420,
+      -0.79370052598400, -7.5e-14, 7.5e-14, 300},
+});
+
+// results match if they reach the same root, and their depths differ by at
+// most max_depth_difference. fused multiply-adds round differently, so a few
+// pixels right on basin boundaries may go to different roots
+static constexpr size_t max_depth_difference = 1;
+static constexpr double max_mismatch_fraction = 0.0001;
+
+static FractalParameters params_for_scene(const Scene& scene) {
+  FractalParameters params;
+  params.coeffs = scene.coeffs;
+  params.w = scene.w;
+  params.h = scene.h;
+  params.xmin = scene.xmin;
+  params.xmax = scene.xmax;
+  params.ymin = scene.ymin;
+  params.ymax = scene.ymax;
+  params.xmin_low = 0.0;
+  params.xmax_low = 0.0;
+  params.ymin_low = 0.0;
+  params.ymax_low = 0.0;
+  params.precision = 0.0000001;
+  params.detect_precision = 0.0001;
+  params.max_iterations = scene.max_iterations;
+  params.result_bit_width = 8;
+  params.subdivide_tolerance = -1;
+  params.progressive_step = 0;
+  params.mixed_precision = false;
+  params.supersample = 1;
+  return params;
+}
+
+struct KernelResult {
+  vector<ssize_t> roots;
+  vector<size_t> depths;
+  uint64_t usecs;
+};
+
+// runs root_batch (or root_batch_dd, if the window needs it) on every row of
+// the scene with the current kernel, and returns the fastest of repeat_count
+// runs
+static KernelResult run_kernel(const FractalParameters& params,
+    size_t repeat_count) {
+  Polynomial poly(params.coeffs);
+  RootSet roots(poly, params.detect_precision);
+  bool double_double = window_needs_double_double(params);
+  double xs = (params.xmax - params.xmin) / params.w;
+  double ys = (params.ymax - params.ymin) / params.h;
+  vector<double> re(params.w), im(params.w);
+  for (size_t x = 0; x < params.w; x++) {
+    re[x] = params.xmin + x * xs;
+  }
+  DoubleDouble xmin_dd = {params.xmin, params.xmin_low};
+  DoubleDouble ymin_dd = {params.ymin, params.ymin_low};
+  DoubleDouble xs_dd = (DoubleDouble{params.xmax, params.xmax_low} - xmin_dd) /
+      DoubleDouble::from_double(params.w);
+  DoubleDouble ys_dd = (DoubleDouble{params.ymax, params.ymax_low} - ymin_dd) /
+      DoubleDouble::from_double(params.h);
+  vector<DoubleDouble> re_dd(params.w), im_dd(params.w);
+  for (size_t x = 0; x < params.w; x++) {
+    re_dd[x] = xmin_dd + DoubleDouble::from_double(x) * xs_dd;
+  }
+
+  KernelResult res;
+  res.roots.resize(params.w * params.h);
+  res.depths.resize(params.w * params.h);
+  res.usecs = UINT64_MAX;
+  for (size_t r = 0; r < repeat_count; r++) {
+    uint64_t start = now();
+    for (size_t y = 0; y < params.h; y++) {
+      if (double_double) {
+        fill(im_dd.begin(), im_dd.end(),
+            ymin_dd + DoubleDouble::from_double(y) * ys_dd);
+        root_batch_dd(poly, roots, re_dd.data(), im_dd.data(), params.w,
+            params.precision, params.max_iterations,
+            res.roots.data() + y * params.w, res.depths.data() + y * params.w);
+      } else {
+        fill(im.begin(), im.end(), params.ymin + y * ys);
+        root_batch(poly, roots, re.data(), im.data(), params.w,
+            params.precision, params.max_iterations,
+            res.roots.data() + y * params.w, res.depths.data() + y * params.w);
+      }
+    }
+    res.usecs = min(res.usecs, now() - start);
+  }
+  return res;
+}
+
+// renders the scene on one thread, and returns the fastest of repeat_count runs
+static FractalResult run_render(const FractalParameters& params,
+    size_t repeat_count, uint64_t* usecs) {
+  FractalResult res;
+  *usecs = UINT64_MAX;
+  for (size_t r = 0; r < repeat_count; r++) {
+    uint64_t start = now();
+    res = julia_fractal(params);
+    *usecs = min(*usecs, now() - start);
+  }
+  return res;
+}
+
+static double per_second(double count, uint64_t usecs) {
+  return count * 1000000.0 / max<uint64_t>(usecs, 1);
+}
+
+static void print_usage(const char* argv0) {
+  fprintf(stderr, "\
+Usage: %s [options]\n\
+\n\
+Options:\n\
+  --scene=NAME: only run this scene (may be given multiple times).\n\
+  --kernel=NAME: only run this kernel (may be given multiple times). The\n\
+      scalar kernel is always run, since it\'s the reference.\n\
+  --max-threads=N: for the render timings, use 1, 2, 4, ... threads, up to\n\
+      this many. Default is the number of CPU cores.\n\
+  --repeat=N: run each test N times and report the fastest (default 3).\n\
+  --no-threads: skip the render timings.\n\
+  --no-mixed: skip the mixed-precision check.\n\
+\n\
+Scenes:", argv0);
+  for (const auto& scene : scenes) {
+    fprintf(stderr, " %s", scene.name);
+  }
+  fprintf(stderr, "\nKernels supported by this CPU:");
+  for (auto kernel : supported_iteration_kernels()) {
+    fprintf(stderr, " %s", name_for_iteration_kernel(kernel));
+  }
+  fputc('\n', stderr);
+}
+
+int main(int argc, char* argv[]) {
+  vector<string> scene_names;
+  vector<string> kernel_names;
+  size_t max_threads = thread::hardware_concurrency();
+  size_t repeat_count = 3;
+  bool run_threads = true;
+  bool run_mixed = true;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--scene=", 8)) {
+      scene_names.emplace_back(&argv[x][8]);
+    } else if (!strncmp(argv[x], "--kernel=", 9)) {
+      kernel_names.emplace_back(&argv[x][9]);
+    } else if (!strncmp(argv[x], "--max-threads=", 14)) {
+      max_threads = atoi(&argv[x][14]);
+    } else if (!strncmp(argv[x], "--repeat=", 9)) {
+      repeat_count = atoi(&argv[x][9]);
+    } else if (!strcmp(argv[x], "--no-threads")) {
+      run_threads = false;
+    } else if (!strcmp(argv[x], "--no-mixed")) {
+      run_mixed = false;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  max_threads = max<size_t>(max_threads, 1);
+  repeat_count = max<size_t>(repeat_count, 1);
+
+  vector<IterationKernel> kernels;
+  for (auto kernel : supported_iteration_kernels()) {
+    if ((kernel == IterationKernel::SCALAR) || kernel_names.empty() ||
+        (find(kernel_names.begin(), kernel_names.end(),
+            name_for_iteration_kernel(kernel)) != kernel_names.end())) {
+      kernels.emplace_back(kernel);
+    }
+  }
+  vector<size_t> thread_counts;
+  for (size_t t = 1; t < max_threads; t *= 2) {
+    thread_counts.emplace_back(t);
+  }
+  thread_counts.emplace_back(max_threads);
+
+  bool all_match = true;
+  for (const auto& scene : scenes) {
+    if (!scene_names.empty() &&
+        (find(scene_names.begin(), scene_names.end(), scene.name) == scene_names.end())) {
+      continue;
+    }
+    FractalParameters params = params_for_scene(scene);
+    size_t pixel_count = params.w * params.h;
+    printf("%s: degree %zu, %zux%zu, x in [%g, %g], y in [%g, %g]\n",
+        scene.name, params.coeffs.size() - 1, params.w, params.h, params.xmin,
+        params.xmax, params.ymin, params.ymax);
+
+    KernelResult reference;
+    for (auto kernel : kernels) {
+      set_iteration_kernel(kernel);
+      KernelResult res = run_kernel(params, repeat_count);
+
+      uint64_t iterations = 0;
+      size_t mismatch_count = 0;
+      size_t max_difference = 0;
+      for (size_t z = 0; z < pixel_count; z++) {
+        iterations += res.depths[z];
+      }
+      if (kernel == IterationKernel::SCALAR) {
+        reference = res;
+      } else {
+        for (size_t z = 0; z < pixel_count; z++) {
+          size_t difference = (res.depths[z] > reference.depths[z])
+              ? (res.depths[z] - reference.depths[z])
+              : (reference.depths[z] - res.depths[z]);
+          if (res.roots[z] != reference.roots[z]) {
+            mismatch_count++;
+          } else {
+            max_difference = max(max_difference, difference);
+            if (difference > max_depth_difference) {
+              mismatch_count++;
+            }
+          }
+        }
+      }
+      bool matches = (mismatch_count <= pixel_count * max_mismatch_fraction);
+      all_match &= matches;
+
+      printf("  %-8s %8.2f Mpixels/s %9.2f Miterations/s  speedup %5.2fx  %s",
+          name_for_iteration_kernel(kernel),
+          per_second(pixel_count, res.usecs) / 1000000.0,
+          per_second(iterations, res.usecs) / 1000000.0,
+          static_cast<double>(reference.usecs) / max<uint64_t>(res.usecs, 1),
+          (kernel == IterationKernel::SCALAR) ? "reference" : (matches ? "ok" : "MISMATCH"));
+      if (kernel != IterationKernel::SCALAR) {
+        printf(" (%zu pixels differ, max depth difference %zu)", mismatch_count,
+            max_difference);
+      }
+      putc('\n', stdout);
+
+      if (run_threads) {
+        printf("          threads:");
+        uint64_t single_thread_usecs = 0;
+        for (size_t thread_count : thread_counts) {
+          uint64_t usecs = UINT64_MAX;
+          for (size_t r = 0; r < repeat_count; r++) {
+            RenderOptions options;
+            options.thread_count = thread_count;
+            uint64_t start = now();
+            julia_fractal(params, options);
+            usecs = min(usecs, now() - start);
+          }
+          if (thread_count == 1) {
+            single_thread_usecs = usecs;
+          }
+          printf("  %zu: %.2f Mpixels/s (%.2fx)", thread_count,
+              per_second(pixel_count, usecs) / 1000000.0,
+              static_cast<double>(single_thread_usecs) / max<uint64_t>(usecs, 1));
+        }
+        putc('\n', stdout);
+      }
+      fflush(stdout);
+    }
+
+    if (run_mixed) {
+      set_iteration_kernel(kernels.back());
+      uint64_t double_usecs, mixed_usecs;
+      FractalResult double_res = run_render(params, repeat_count, &double_usecs);
+      params.mixed_precision = true;
+      FractalResult mixed_res = run_render(params, repeat_count, &mixed_usecs);
+      params.mixed_precision = false;
+
+      size_t root_mismatch_count = 0;
+      size_t depth_mismatch_count = 0;
+      for (size_t y = 0; y < params.h; y++) {
+        for (size_t x = 0; x < params.w; x++) {
+          uint64_t double_depth = double_res.data.get_depth(x, y);
+          uint64_t mixed_depth = mixed_res.data.get_depth(x, y);
+          if (double_res.data.get_root(x, y) != mixed_res.data.get_root(x, y)) {
+            root_mismatch_count++;
+          } else if (((double_depth > mixed_depth) ? (double_depth - mixed_depth)
+              : (mixed_depth - double_depth)) > max_depth_difference) {
+            depth_mismatch_count++;
+          }
+        }
+      }
+      bool matches = !root_mismatch_count && !depth_mismatch_count &&
+          (double_res.roots == mixed_res.roots);
+      all_match &= matches;
+      printf("  mixed    %8.2f Mpixels/s (double: %.2f)  speedup %5.2fx  %s"
+          " (%zu roots differ, %zu depths differ)\n",
+          per_second(pixel_count, mixed_usecs) / 1000000.0,
+          per_second(pixel_count, double_usecs) / 1000000.0,
+          static_cast<double>(double_usecs) / max<uint64_t>(mixed_usecs, 1),
+          matches ? "ok" : "MISMATCH", root_mismatch_count,
+          depth_mismatch_count);
+      fflush(stdout);
+    }
+  }
+
+  if (!all_match) {
+    printf("some results don\'t match the reference\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include "Color.hh"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "Pipeline.hh"
+
+using namespace std;
+
+
+struct Color {
+  uint8_t r, g, b;
+};
+
+static const vector<Color> colors({
+  {0xFF, 0x00, 0x00}, // red
+  {0xFF, 0x80, 0x00}, // orange
+  {0xFF, 0xFF, 0x00}, // yellow
+  {0x00, 0xFF, 0x00}, // green
+  {0x00, 0xFF, 0xFF}, // cyan
+  {0x00, 0x00, 0xFF}, // blue
+  {0xFF, 0x00, 0xFF}, // magenta
+  {0xFF, 0x80, 0x80}, // light red
+  {0xFF, 0xC0, 0x80}, // light orange
+  {0xFF, 0xFF, 0x80}, // light yellow
+  {0x80, 0xFF, 0x80}, // light green
+  {0x80, 0xFF, 0xFF}, // light cyan
+  {0x80, 0x80, 0xFF}, // light blue
+  {0xFF, 0x80, 0xFF}, // light magenta
+  {0x80, 0x00, 0x00}, // dark red
+  {0x80, 0x40, 0x00}, // dark orange
+  {0x80, 0x80, 0x00}, // dark yellow
+  {0x00, 0x80, 0x00}, // dark green
+  {0x00, 0x80, 0x80}, // dark cyan
+  {0x00, 0x00, 0x80}, // dark blue
+  {0x80, 0x00, 0x80}, // dark purple
+});
+
+// if the depth range is larger than this, colors are computed for each pixel
+// instead of being looked up
+static constexpr uint64_t max_lookup_depths = 0x10000;
+
+Image color_fractal(const ResultBuffer& data, int64_t min_intensity,
+    int64_t max_intensity, const vector<ssize_t>& replacement_map,
+    size_t thread_count, const Supersamples* supersamples) {
+  Image result;
+  color_fractal(result, data, min_intensity, max_intensity, replacement_map,
+      thread_count, supersamples);
+  return result;
+}
+
+Image color_fractal(const FractalResult& res, int64_t min_intensity,
+    int64_t max_intensity, size_t thread_count) {
+  return color_fractal(res.data, min_intensity, max_intensity,
+      res.root_colors, thread_count, &res.supersamples);
+}
+
+void color_fractal(Image& result, const ResultBuffer& data,
+    int64_t min_intensity, int64_t max_intensity,
+    const vector<ssize_t>& replacement_map, size_t thread_count,
+    const Supersamples* supersamples) {
+  size_t w = data.get_width(), h = data.get_height();
+  const uint8_t* roots = data.get_roots();
+
+  // compute the min and max depths in the entire frame, if needed
+  if ((min_intensity < 0) || (max_intensity < 0)) {
+    uint64_t depth_min = UINT64_MAX, depth_max = 0;
+    mutex range_lock;
+    data.visit_depths([&](const auto* depths) {
+      for_each_band(h, thread_count, [&](size_t y_start, size_t y_end) {
+        uint64_t band_min = UINT64_MAX, band_max = 0;
+        for (size_t z = y_start * w; z < y_end * w; z++) {
+          if (ResultBuffer::is_root_index(roots[z])) {
+            band_min = min<uint64_t>(band_min, depths[z]);
+            band_max = max<uint64_t>(band_max, depths[z]);
+          }
+        }
+        lock_guard<mutex> g(range_lock);
+        depth_min = min(depth_min, band_min);
+        depth_max = max(depth_max, band_max);
+      });
+    });
+    if (depth_min > depth_max) {
+      depth_min = depth_max = 0; // no pixel reached a root
+    }
+
+    // a computed bound never crosses a given one
+    if (min_intensity < 0) {
+      min_intensity = depth_min;
+      if (max_intensity >= 0) {
+        min_intensity = min(min_intensity, max_intensity);
+      }
+    }
+    if (max_intensity < 0) {
+      max_intensity = max<int64_t>(depth_max, min_intensity);
+    }
+  }
+
+  uint64_t min_depth = min_intensity, max_depth = max_intensity;
+  uint64_t intensity_range = (max_depth > min_depth) ? (max_depth - min_depth) : 0;
+  auto depth_color = [&](size_t color_index, uint64_t depth) -> Color {
+    depth = min(max(depth, min_depth), max_depth);
+    const Color& color = colors[color_index];
+    if (intensity_range == 0) {
+      return (depth >= max_depth) ? color : Color{0, 0, 0};
+    }
+    uint64_t offset = depth - min_depth;
+    if (intensity_range >= max_lookup_depths) {
+      // offset * 0xFF could overflow
+      double f = static_cast<double>(offset) / intensity_range;
+      return {static_cast<uint8_t>(f * color.r), static_cast<uint8_t>(f * color.g),
+          static_cast<uint8_t>(f * color.b)};
+    }
+    return {
+        static_cast<uint8_t>((offset * color.r) / intensity_range),
+        static_cast<uint8_t>((offset * color.g) / intensity_range),
+        static_cast<uint8_t>((offset * color.b) / intensity_range)};
+  };
+
+  // root_color[r] is the color index for root r, or one of the two indexes
+  // after the last color, for pixels that didn't reach a root (white) and for
+  // pixels caught in cycles (gray). roots with a negative color index in
+  // replacement_map (e.g. roots that a RootTracker couldn't match) are white
+  // too. the table below has a row for each of these indexes; row_for_root[r]
+  // is the offset of the row for root r
+  const size_t error_color = colors.size();
+  const size_t cycle_color = colors.size() + 1;
+  bool use_table = (intensity_range < max_lookup_depths);
+  size_t row_size = use_table ? (intensity_range + 1) : 0;
+  size_t root_color[0x100];
+  size_t row_for_root[0x100];
+  for (size_t r = 0; r < 0x100; r++) {
+    ssize_t color_index = (r < replacement_map.size()) ? replacement_map[r] : r;
+    if (r == ResultBuffer::ERROR_ROOT) {
+      root_color[r] = error_color;
+    } else if (r == ResultBuffer::CYCLE_ROOT) {
+      root_color[r] = cycle_color;
+    } else if (color_index < 0) {
+      root_color[r] = error_color;
+    } else {
+      root_color[r] = color_index % colors.size();
+    }
+    row_for_root[r] = root_color[r] * row_size;
+  }
+
+  vector<Color> table;
+  if (use_table) {
+    table.reserve((colors.size() + 1) * row_size);
+    for (size_t c = 0; c < colors.size(); c++) {
+      for (uint64_t offset = 0; offset < row_size; offset++) {
+        table.emplace_back(depth_color(c, min_depth + offset));
+      }
+    }
+    table.resize((colors.size() + 1) * row_size, Color{0xFF, 0xFF, 0xFF});
+    table.resize((colors.size() + 2) * row_size, Color{0x80, 0x80, 0x80});
+  }
+
+  // convert the depths and root indexes into colors
+  if ((result.get_width() != w) || (result.get_height() != h)) {
+    result = Image(w, h);
+  }
+  auto pixel_color = [&](uint8_t root, uint64_t depth) -> Color {
+    if (use_table) {
+      depth = min<uint64_t>(max<uint64_t>(depth, min_depth), max_depth);
+      return table[row_for_root[root] + (depth - min_depth)];
+    } else if (root_color[root] == error_color) {
+      return {0xFF, 0xFF, 0xFF};
+    } else if (root_color[root] == cycle_color) {
+      return {0x80, 0x80, 0x80};
+    }
+    return depth_color(root_color[root], depth);
+  };
+  uint8_t* pixels = reinterpret_cast<uint8_t*>(result.get_data());
+  data.visit_depths([&](const auto* depths) {
+    for_each_band(h, thread_count, [&](size_t y_start, size_t y_end) {
+      for (size_t z = y_start * w; z < y_end * w; z++) {
+        Color c = pixel_color(roots[z], depths[z]);
+        pixels[3 * z + 0] = c.r;
+        pixels[3 * z + 1] = c.g;
+        pixels[3 * z + 2] = c.b;
+      }
+    });
+  });
+
+  // supersampled pixels are the average of their samples' colors
+  if (supersamples && !supersamples->pixels.empty()) {
+    const ResultBuffer& samples = supersamples->samples;
+    size_t samples_per_pixel = samples.get_width();
+    const uint8_t* sample_roots = samples.get_roots();
+    samples.visit_depths([&](const auto* sample_depths) {
+      for_each_band(samples.get_height(), thread_count, [&](size_t p_start, size_t p_end) {
+        for (size_t p = p_start; p < p_end; p++) {
+          uint64_t r = 0, g = 0, b = 0;
+          for (size_t s = p * samples_per_pixel; s < (p + 1) * samples_per_pixel; s++) {
+            Color c = pixel_color(sample_roots[s], sample_depths[s]);
+            r += c.r;
+            g += c.g;
+            b += c.b;
+          }
+          uint8_t* pixel = pixels + 3 * supersamples->pixels[p];
+          pixel[0] = (r + samples_per_pixel / 2) / samples_per_pixel;
+          pixel[1] = (g + samples_per_pixel / 2) / samples_per_pixel;
+          pixel[2] = (b + samples_per_pixel / 2) / samples_per_pixel;
+        }
+      });
+    });
+  }
+}
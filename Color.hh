@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <phosg/Image.hh>
+#include <vector>
+
+#include "JuliaSet.hh"
+#include "ResultBuffer.hh"
+
+
+// Converts a frame's results to an RGB image. Each root gets its own color,
+// and the brightness of each pixel shows its depth: pixels at min_intensity or
+// less are black, and pixels at max_intensity or more are the root's full
+// color. If either of these is negative, it's the minimum or maximum depth
+// over the whole frame instead. Pixels that didn't reach a root are white, and
+// pixels caught in cycles are gray.
+// replacement_map[x], if present, is the color to use for root x; roots whose
+// color is negative (unassigned) are white, like pixels that didn't reach a
+// root. If supersamples is given, each of its pixels is colored with the
+// average of its samples' colors instead. The work is split up among
+// thread_count threads.
+Image color_fractal(const ResultBuffer& data, int64_t min_intensity = -1,
+    int64_t max_intensity = -1,
+    const std::vector<ssize_t>& replacement_map = std::vector<ssize_t>(),
+    size_t thread_count = 1, const Supersamples* supersamples = nullptr);
+
+// same as above, but writes the image to result, so the same image can be
+// used for many frames. result is only reallocated if it's the wrong size
+void color_fractal(Image& result, const ResultBuffer& data,
+    int64_t min_intensity = -1, int64_t max_intensity = -1,
+    const std::vector<ssize_t>& replacement_map = std::vector<ssize_t>(),
+    size_t thread_count = 1, const Supersamples* supersamples = nullptr);
+
+// colors a rendered frame, with its root colors (if the roots were given in
+// its parameters) and its supersamples
+Image color_fractal(const FractalResult& res, int64_t min_intensity = -1,
+    int64_t max_intensity = -1, size_t thread_count = 1);
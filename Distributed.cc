@@ -0,0 +1,390 @@
+#include "Distributed.hh"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "ResultCache.hh"
+
+using namespace std;
+
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t unused;
+  uint64_t size;
+  uint64_t compressed_size;
+};
+
+// no message is this big; a header that says otherwise is garbage
+static constexpr uint64_t max_message_size = 1ULL << 40;
+
+
+static bool is_unix_address(const string& address) {
+  return address.find('/') != string::npos;
+}
+
+static sockaddr_un unix_address(const string& path) {
+  sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(sun.sun_path)) {
+    throw invalid_argument("socket path is too long: " + path);
+  }
+  strcpy(sun.sun_path, path.c_str());
+  return sun;
+}
+
+// returns the addresses for host:port (or just port, if passive)
+static addrinfo* resolve_tcp_address(const string& address, bool passive) {
+  size_t colon_offset = address.rfind(':');
+  string host, port;
+  if (colon_offset == string::npos) {
+    if (!passive) {
+      throw invalid_argument("address must be host:port: " + address);
+    }
+    port = address;
+  } else {
+    host = address.substr(0, colon_offset);
+    port = address.substr(colon_offset + 1);
+  }
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo* res = NULL;
+  int error = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+      &hints, &res);
+  if (error) {
+    throw runtime_error(string_printf("can\'t resolve %s: %s", address.c_str(),
+        gai_strerror(error)));
+  }
+  return res;
+}
+
+int listen_socket(const string& address) {
+  if (is_unix_address(address)) {
+    // remove the socket left behind by a previous coordinator, if any
+    struct stat st;
+    if (!stat(address.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+      unlink(address.c_str());
+    }
+
+    sockaddr_un sun = unix_address(address);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      throw runtime_error(string_printf("can\'t create socket: %s", strerror(errno)));
+    }
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&sun), sizeof(sun)) ||
+        listen(fd, SOMAXCONN)) {
+      int error = errno;
+      close(fd);
+      throw runtime_error(string_printf("can\'t listen on %s: %s",
+          address.c_str(), strerror(error)));
+    }
+    return fd;
+  }
+
+  addrinfo* res = resolve_tcp_address(address, true);
+  int error = 0;
+  for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, SOMAXCONN)) {
+      freeaddrinfo(res);
+      return fd;
+    }
+    error = errno;
+    close(fd);
+  }
+  freeaddrinfo(res);
+  throw runtime_error(string_printf("can\'t listen on %s: %s", address.c_str(),
+      strerror(error)));
+}
+
+int accept_socket(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    throw runtime_error(string_printf("can\'t accept connection: %s", strerror(errno)));
+  }
+
+  sockaddr_storage addr;
+  socklen_t addr_size = sizeof(addr);
+  if (!getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_size) &&
+      (addr.ss_family != AF_UNIX)) {
+    // give up on the worker after about 25 seconds of silence
+    int yes = 1, idle = 10, interval = 5, count = 3;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  }
+  return fd;
+}
+
+int connect_socket(const string& address) {
+  if (is_unix_address(address)) {
+    sockaddr_un sun = unix_address(address);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      throw runtime_error(string_printf("can\'t create socket: %s", strerror(errno)));
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&sun), sizeof(sun))) {
+      int error = errno;
+      close(fd);
+      throw runtime_error(string_printf("can\'t connect to %s: %s",
+          address.c_str(), strerror(error)));
+    }
+    return fd;
+  }
+
+  addrinfo* res = resolve_tcp_address(address, false);
+  int error = 0;
+  for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      freeaddrinfo(res);
+      return fd;
+    }
+    error = errno;
+    close(fd);
+  }
+  freeaddrinfo(res);
+  throw runtime_error(string_printf("can\'t connect to %s: %s",
+      address.c_str(), strerror(error)));
+}
+
+
+static void send_all(int fd, const void* data, size_t size) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  while (size) {
+    // MSG_NOSIGNAL: if the other end is gone, fail instead of getting SIGPIPE
+    ssize_t bytes_sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error(string_printf("can\'t send: %s", strerror(errno)));
+    }
+    p += bytes_sent;
+    size -= bytes_sent;
+  }
+}
+
+// returns false if the connection is closed before anything is received
+static bool receive_all(int fd, void* data, size_t size) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(data);
+  size_t bytes_left = size;
+  while (bytes_left) {
+    ssize_t bytes_read = recv(fd, p, bytes_left, 0);
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error(string_printf("can\'t receive: %s", strerror(errno)));
+    }
+    if (bytes_read == 0) {
+      if (bytes_left == size) {
+        return false;
+      }
+      throw runtime_error("connection closed in the middle of a message");
+    }
+    p += bytes_read;
+    bytes_left -= bytes_read;
+  }
+  return true;
+}
+
+void send_message(int fd, MessageType type, const string& data) {
+  // results are large and mostly runs of similar values, so the fastest
+  // compression level shrinks them a lot without slowing anything down
+  uLongf compressed_size = compressBound(data.size());
+  string compressed(compressed_size, '\0');
+  int error = compress2(reinterpret_cast<Bytef*>(compressed.data()),
+      &compressed_size, reinterpret_cast<const Bytef*>(data.data()),
+      data.size(), Z_BEST_SPEED);
+  if (error != Z_OK) {
+    throw runtime_error(string_printf("can\'t compress message (%d)", error));
+  }
+
+  MessageHeader header;
+  header.type = static_cast<uint32_t>(type);
+  header.unused = 0;
+  header.size = data.size();
+  header.compressed_size = compressed_size;
+  send_all(fd, &header, sizeof(header));
+  send_all(fd, compressed.data(), compressed_size);
+}
+
+bool receive_message(int fd, MessageType& type, string& data) {
+  MessageHeader header;
+  if (!receive_all(fd, &header, sizeof(header))) {
+    return false;
+  }
+  if ((header.size > max_message_size) ||
+      (header.compressed_size > compressBound(header.size))) {
+    throw runtime_error("received an invalid message header");
+  }
+
+  string compressed(header.compressed_size, '\0');
+  if (!receive_all(fd, compressed.data(), compressed.size())) {
+    throw runtime_error("connection closed in the middle of a message");
+  }
+  data.resize(header.size);
+  uLongf size = header.size;
+  int error = uncompress(reinterpret_cast<Bytef*>(data.data()), &size,
+      reinterpret_cast<const Bytef*>(compressed.data()), compressed.size());
+  if ((error != Z_OK) || (size != header.size)) {
+    throw runtime_error(string_printf("can\'t decompress message (%d)", error));
+  }
+  type = static_cast<MessageType>(header.type);
+  return true;
+}
+
+
+template <typename T>
+static void append_value(string& data, const T& v) {
+  data.append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+static void append_vector(string& data, const vector<T>& v) {
+  append_value<uint64_t>(data, v.size());
+  data.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+template <typename T>
+static T read_value(const string& data, size_t& offset) {
+  if (offset + sizeof(T) > data.size()) {
+    throw runtime_error("parameters are truncated");
+  }
+  T v;
+  memcpy(&v, data.data() + offset, sizeof(T));
+  offset += sizeof(T);
+  return v;
+}
+
+template <typename T>
+static vector<T> read_vector(const string& data, size_t& offset) {
+  uint64_t count = read_value<uint64_t>(data, offset);
+  if (count > (data.size() - offset) / sizeof(T)) {
+    throw runtime_error("parameters are truncated");
+  }
+  vector<T> ret(count);
+  memcpy(ret.data(), data.data() + offset, count * sizeof(T));
+  offset += count * sizeof(T);
+  return ret;
+}
+
+string serialize_parameters(const FractalParameters& params) {
+  string data;
+  append_vector(data, params.coeffs);
+  append_value<uint64_t>(data, params.w);
+  append_value<uint64_t>(data, params.h);
+  append_value(data, params.xmin);
+  append_value(data, params.xmax);
+  append_value(data, params.ymin);
+  append_value(data, params.ymax);
+  append_value(data, params.xmin_low);
+  append_value(data, params.xmax_low);
+  append_value(data, params.ymin_low);
+  append_value(data, params.ymax_low);
+  append_value(data, params.precision);
+  append_value(data, params.detect_precision);
+  append_value<uint64_t>(data, params.max_iterations);
+  append_value<uint64_t>(data, params.result_bit_width);
+  append_value<int64_t>(data, params.subdivide_tolerance);
+  append_value<uint64_t>(data, params.progressive_step);
+  append_value<uint8_t>(data, params.mixed_precision);
+  append_value<uint64_t>(data, params.supersample);
+  append_vector(data, params.roots);
+  append_vector(data, params.root_colors);
+  return data;
+}
+
+FractalParameters parse_parameters(const string& data) {
+  FractalParameters params;
+  size_t offset = 0;
+  params.coeffs = read_vector<complex>(data, offset);
+  params.w = read_value<uint64_t>(data, offset);
+  params.h = read_value<uint64_t>(data, offset);
+  params.xmin = read_value<double>(data, offset);
+  params.xmax = read_value<double>(data, offset);
+  params.ymin = read_value<double>(data, offset);
+  params.ymax = read_value<double>(data, offset);
+  params.xmin_low = read_value<double>(data, offset);
+  params.xmax_low = read_value<double>(data, offset);
+  params.ymin_low = read_value<double>(data, offset);
+  params.ymax_low = read_value<double>(data, offset);
+  params.precision = read_value<double>(data, offset);
+  params.detect_precision = read_value<double>(data, offset);
+  params.max_iterations = read_value<uint64_t>(data, offset);
+  params.result_bit_width = read_value<uint64_t>(data, offset);
+  params.subdivide_tolerance = read_value<int64_t>(data, offset);
+  params.progressive_step = read_value<uint64_t>(data, offset);
+  params.mixed_precision = read_value<uint8_t>(data, offset);
+  params.supersample = read_value<uint64_t>(data, offset);
+  params.roots = read_vector<complex>(data, offset);
+  params.root_colors = read_vector<size_t>(data, offset);
+  if (offset != data.size()) {
+    throw runtime_error("parameters have extra data at the end");
+  }
+  return params;
+}
+
+
+void run_worker(const string& address, size_t thread_count) {
+  int fd = connect_socket(address);
+  try {
+    MessageType type;
+    string data;
+    while (receive_message(fd, type, data) && (type != MessageType::DONE)) {
+      if (type != MessageType::RENDER_FRAME) {
+        throw runtime_error(string_printf("received unexpected message type %u",
+            static_cast<uint32_t>(type)));
+      }
+
+      // errors in rendering are sent back to the coordinator, since the
+      // frame would fail the same way on any other worker
+      string response;
+      MessageType response_type;
+      try {
+        FractalParameters params = parse_parameters(data);
+        RenderOptions options;
+        options.thread_count = thread_count;
+        FractalResult res = julia_fractal(params, options);
+        response = ResultCache::serialize(ResultCache::key(params), res);
+        response_type = MessageType::FRAME_RESULT;
+      } catch (const exception& e) {
+        response = e.what();
+        response_type = MessageType::FRAME_ERROR;
+      }
+      send_message(fd, response_type, response);
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "JuliaSet.hh"
+
+
+// Support for rendering a video with several processes, possibly on different
+// machines. One process (the coordinator) listens for connections from worker
+// processes, sends each of them one frame's parameters at a time, and gets the
+// frame's raw results back; it does everything else (following the roots,
+// coloring and writing the output) itself.
+//
+// Addresses are either the path of a Unix socket (anything containing a /), or
+// host:port for TCP; when listening, the host may be omitted to listen on all
+// interfaces.
+//
+// Every message is a MessageHeader followed by its zlib-compressed contents.
+// The coordinator sends RENDER_FRAME (the parameters) or DONE, and the worker
+// replies to each RENDER_FRAME with FRAME_RESULT (the result, in the cache file
+// format; see ResultCache) or FRAME_ERROR (a message).
+
+enum class MessageType : uint32_t {
+  RENDER_FRAME = 1,
+  FRAME_RESULT = 2,
+  FRAME_ERROR = 3,
+  DONE = 4,
+};
+
+int listen_socket(const std::string& address);
+// also turns on TCP keepalives, so a worker that disappears without closing
+// the connection (e.g. if its machine crashes) is noticed
+int accept_socket(int listen_fd);
+int connect_socket(const std::string& address);
+
+void send_message(int fd, MessageType type, const std::string& data);
+// returns false if the connection was closed between messages
+bool receive_message(int fd, MessageType& type, std::string& data);
+
+std::string serialize_parameters(const FractalParameters& params);
+FractalParameters parse_parameters(const std::string& data);
+
+// connects to a coordinator and renders frames for it until it says there are
+// no more, using thread_count threads for each frame
+void run_worker(const std::string& address, size_t thread_count);
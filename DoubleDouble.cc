@@ -0,0 +1,127 @@
+#include "DoubleDouble.hh"
+
+#include <math.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+
+// The basic error-free transformations. two_sum and two_prod return a + b and
+// a * b as a double plus the rounding error (exactly); quick_two_sum does the
+// same as two_sum, but only if |a| >= |b|.
+
+static inline DoubleDouble two_sum(double a, double b) {
+  double s = a + b;
+  double bb = s - a;
+  return {s, (a - (s - bb)) + (b - bb)};
+}
+
+static inline DoubleDouble quick_two_sum(double a, double b) {
+  double s = a + b;
+  return {s, b - (s - a)};
+}
+
+static inline DoubleDouble two_prod(double a, double b) {
+  double p = a * b;
+#if defined(__FMA__)
+  return {p, fma(a, b, -p)};
+#else
+  // without a fused multiply-add, split each factor into halves whose
+  // products are exact (Dekker's algorithm)
+  static constexpr double splitter = 134217729.0; // 2^27 + 1
+  double at = splitter * a;
+  double a_hi = at - (at - a), a_lo = a - a_hi;
+  double bt = splitter * b;
+  double b_hi = bt - (bt - b), b_lo = b - b_hi;
+  return {p, ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo};
+#endif
+}
+
+DoubleDouble DoubleDouble::from_double(double v) {
+  return {v, 0.0};
+}
+
+DoubleDouble DoubleDouble::parse(const char* text) {
+  const char* p = text;
+  bool negative = (*p == '-');
+  if ((*p == '-') || (*p == '+')) {
+    p++;
+  }
+
+  // accumulate all the digits as an integer, then scale it by the exponent
+  DoubleDouble ret = {0.0, 0.0};
+  DoubleDouble ten = {10.0, 0.0};
+  size_t digit_count = 0;
+  ssize_t exponent = 0;
+  bool seen_point = false;
+  for (; *p; p++) {
+    if ((*p >= '0') && (*p <= '9')) {
+      ret = ret * ten + DoubleDouble{static_cast<double>(*p - '0'), 0.0};
+      digit_count++;
+      exponent -= seen_point;
+    } else if ((*p == '.') && !seen_point) {
+      seen_point = true;
+    } else {
+      break;
+    }
+  }
+  if ((*p == 'e') || (*p == 'E')) {
+    char* end;
+    exponent += strtol(p + 1, &end, 10);
+    if (end == p + 1) {
+      digit_count = 0;
+    }
+    p = end;
+  }
+  if (!digit_count || *p) {
+    throw invalid_argument("text is not a number");
+  }
+
+  DoubleDouble scale = {1.0, 0.0};
+  for (ssize_t x = 0; (x < (exponent < 0 ? -exponent : exponent)) &&
+      isfinite(scale.hi); x++) {
+    scale = scale * ten;
+  }
+  ret = (exponent < 0) ? (ret / scale) : (ret * scale);
+  return negative ? -ret : ret;
+}
+
+double DoubleDouble::to_double() const {
+  return this->hi + this->lo;
+}
+
+DoubleDouble operator+(const DoubleDouble& a, const DoubleDouble& b) {
+  DoubleDouble s = two_sum(a.hi, b.hi);
+  DoubleDouble t = two_sum(a.lo, b.lo);
+  s.lo += t.hi;
+  s = quick_two_sum(s.hi, s.lo);
+  s.lo += t.lo;
+  return quick_two_sum(s.hi, s.lo);
+}
+
+DoubleDouble operator-(const DoubleDouble& a) {
+  return {-a.hi, -a.lo};
+}
+
+DoubleDouble operator-(const DoubleDouble& a, const DoubleDouble& b) {
+  return a + (-b);
+}
+
+DoubleDouble operator*(const DoubleDouble& a, const DoubleDouble& b) {
+  DoubleDouble p = two_prod(a.hi, b.hi);
+  p.lo += a.hi * b.lo + a.lo * b.hi;
+  return quick_two_sum(p.hi, p.lo);
+}
+
+DoubleDouble operator/(const DoubleDouble& a, const DoubleDouble& b) {
+  // long division, one double's worth of quotient at a time
+  double q1 = a.hi / b.hi;
+  DoubleDouble r = a - b * DoubleDouble{q1, 0.0};
+  double q2 = r.hi / b.hi;
+  r = r - b * DoubleDouble{q2, 0.0};
+  double q3 = r.hi / b.hi;
+  return quick_two_sum(q1, q2) + DoubleDouble{q3, 0.0};
+}
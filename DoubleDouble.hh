@@ -0,0 +1,30 @@
+#pragma once
+
+
+// A number represented as the unevaluated sum of two doubles (hi is the double
+// nearest to the number, and lo is the rest), which gives about 106 bits of
+// mantissa. This is used for the window coordinates when the window is too
+// small for doubles, e.g. for deep zooms into basin boundaries.
+//
+// This is deliberately an aggregate with all its operations defined out of
+// line: the vector kernels (see IterateSIMD.hh) use arrays of these, and must
+// not pull in any inline functions. They have their own vectorized versions of
+// these operations.
+struct DoubleDouble {
+  double hi;
+  double lo;
+
+  static DoubleDouble from_double(double v);
+  // parses a decimal number (with an optional exponent), keeping about 32
+  // significant digits. throws invalid_argument if text isn't a number
+  static DoubleDouble parse(const char* text);
+
+  // returns hi + lo, rounded to the nearest double
+  double to_double() const;
+};
+
+DoubleDouble operator+(const DoubleDouble& a, const DoubleDouble& b);
+DoubleDouble operator-(const DoubleDouble& a, const DoubleDouble& b);
+DoubleDouble operator-(const DoubleDouble& a);
+DoubleDouble operator*(const DoubleDouble& a, const DoubleDouble& b);
+DoubleDouble operator/(const DoubleDouble& a, const DoubleDouble& b);
@@ -0,0 +1,313 @@
+#include "Encode.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <vector>
+
+#include "Pipeline.hh"
+
+using namespace std;
+
+
+OutputFormat output_format_for_name(const char* name) {
+  if (!strcmp(name, "bmp")) {
+    return OutputFormat::BMP;
+  } else if (!strcmp(name, "png")) {
+    return OutputFormat::PNG;
+  } else if (!strcmp(name, "y4m")) {
+    return OutputFormat::Y4M;
+  } else if (!strcmp(name, "raw")) {
+    return OutputFormat::RAW;
+  }
+  throw invalid_argument(string_printf(
+      "unknown output format: %s (expected bmp, png, y4m or raw)", name));
+}
+
+const char* name_for_output_format(OutputFormat format) {
+  switch (format) {
+    case OutputFormat::BMP:
+      return "bmp";
+    case OutputFormat::PNG:
+      return "png";
+    case OutputFormat::Y4M:
+      return "y4m";
+    case OutputFormat::RAW:
+      return "raw";
+  }
+  throw logic_error("invalid output format");
+}
+
+OutputFormat output_format_for_filename(const string& filename,
+    OutputFormat default_format) {
+  size_t dot = filename.rfind('.');
+  if ((dot == string::npos) || (filename.find('/', dot) != string::npos)) {
+    return default_format;
+  }
+  try {
+    return output_format_for_name(filename.c_str() + dot + 1);
+  } catch (const invalid_argument&) {
+    return default_format;
+  }
+}
+
+bool is_stream_output_format(OutputFormat format) {
+  return (format == OutputFormat::Y4M) || (format == OutputFormat::RAW);
+}
+
+string encode_stream_header(OutputFormat format, size_t w, size_t h,
+    uint64_t frame_rate) {
+  if (format == OutputFormat::Y4M) {
+    return string_printf("YUV4MPEG2 W%zu H%zu F%" PRIu64 ":1 Ip A1:1 C420jpeg\n",
+        w, h, frame_rate);
+  } else if (format == OutputFormat::RAW) {
+    return string_printf("zroot-rgb24 %zu %zu\n", w, h);
+  }
+  return "";
+}
+
+
+
+static string encode_bmp(const Image& img) {
+  char* data = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&data, &size);
+  if (!f) {
+    throw runtime_error("can\'t open memory stream");
+  }
+  try {
+    img.save(f, Image::Format::WINDOWS_BITMAP);
+  } catch (...) {
+    fclose(f);
+    free(data);
+    throw;
+  }
+  fclose(f);
+  string ret(data, size);
+  free(data);
+  return ret;
+}
+
+static string encode_y4m(const Image& img, size_t thread_count) {
+  // each chroma sample covers a 2x2 block of pixels (or less, at the right
+  // and bottom edges if the size is odd). the conversion is BT.601 with the
+  // usual 16-235 luma range, in fixed point
+  size_t w = img.get_width(), h = img.get_height();
+  size_t cw = (w + 1) / 2, ch = (h + 1) / 2;
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(img.get_data());
+
+  static const char frame_header[] = "FRAME\n";
+  string ret(sizeof(frame_header) - 1 + w * h + 2 * cw * ch, '\0');
+  memcpy(ret.data(), frame_header, sizeof(frame_header) - 1);
+  uint8_t* y_plane = reinterpret_cast<uint8_t*>(ret.data()) + sizeof(frame_header) - 1;
+  uint8_t* u_plane = y_plane + w * h;
+  uint8_t* v_plane = u_plane + cw * ch;
+
+  for_each_band(ch, thread_count, [&](size_t cy_start, size_t cy_end) {
+    for (size_t cy = cy_start; cy < cy_end; cy++) {
+      size_t y_end = min<size_t>(2 * cy + 2, h);
+      for (size_t y = 2 * cy; y < y_end; y++) {
+        const uint8_t* row = pixels + 3 * w * y;
+        for (size_t x = 0; x < w; x++) {
+          int32_t r = row[3 * x], g = row[3 * x + 1], b = row[3 * x + 2];
+          y_plane[w * y + x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        }
+      }
+
+      for (size_t cx = 0; cx < cw; cx++) {
+        size_t x_end = min<size_t>(2 * cx + 2, w);
+        int32_t r = 0, g = 0, b = 0, count = 0;
+        for (size_t y = 2 * cy; y < y_end; y++) {
+          for (size_t x = 2 * cx; x < x_end; x++) {
+            const uint8_t* p = pixels + 3 * (w * y + x);
+            r += p[0];
+            g += p[1];
+            b += p[2];
+            count++;
+          }
+        }
+        r = (r + count / 2) / count;
+        g = (g + count / 2) / count;
+        b = (b + count / 2) / count;
+        u_plane[cw * cy + cx] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v_plane[cw * cy + cx] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+      }
+    }
+  });
+  return ret;
+}
+
+static string encode_raw(const Image& img) {
+  return string(reinterpret_cast<const char*>(img.get_data()),
+      3 * img.get_width() * img.get_height());
+}
+
+
+
+static void append_be32(string& data, uint32_t v) {
+  data.push_back(v >> 24);
+  data.push_back(v >> 16);
+  data.push_back(v >> 8);
+  data.push_back(v);
+}
+
+static void append_png_chunk(string& data, const char* type,
+    const string& contents) {
+  append_be32(data, contents.size());
+  size_t type_offset = data.size();
+  data.append(type, 4);
+  data += contents;
+  append_be32(data, crc32(0, reinterpret_cast<const Bytef*>(data.data() + type_offset),
+      contents.size() + 4));
+}
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+  int32_t p = a + b - c;
+  int32_t pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc)) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+// writes row y of the image to out (1 + 3 * w bytes), with whichever of the
+// five PNG filters gives the smallest sum of absolute values (as signed
+// bytes), which is the usual heuristic for choosing filters. candidate must
+// have room for 3 * w bytes
+static void filter_png_row(const uint8_t* pixels, size_t w, size_t y,
+    uint8_t* out, uint8_t* candidate) {
+  size_t row_size = 3 * w;
+  const uint8_t* row = pixels + row_size * y;
+  const uint8_t* prev = y ? (row - row_size) : NULL;
+
+  uint64_t best_cost = UINT64_MAX;
+  for (uint8_t filter = 0; filter < 5; filter++) {
+    uint64_t cost = 0;
+    for (size_t x = 0; x < row_size; x++) {
+      uint8_t a = (x >= 3) ? row[x - 3] : 0;
+      uint8_t b = prev ? prev[x] : 0;
+      uint8_t c = (prev && (x >= 3)) ? prev[x - 3] : 0;
+      uint8_t v = row[x];
+      switch (filter) {
+        case 1:
+          v -= a;
+          break;
+        case 2:
+          v -= b;
+          break;
+        case 3:
+          v -= (a + b) / 2;
+          break;
+        case 4:
+          v -= paeth_predictor(a, b, c);
+          break;
+      }
+      candidate[x] = v;
+      cost += abs(static_cast<int8_t>(v));
+    }
+    if (cost < best_cost) {
+      best_cost = cost;
+      out[0] = filter;
+      memcpy(out + 1, candidate, row_size);
+    }
+  }
+}
+
+static string encode_png(const Image& img, size_t thread_count) {
+  size_t w = img.get_width(), h = img.get_height();
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(img.get_data());
+  size_t filtered_row_size = 3 * w + 1;
+
+  // the image data is one zlib stream, but each band of rows is filtered and
+  // compressed separately, like pigz does: every band but the last ends with a
+  // sync flush (so it ends on a byte boundary and the next band can be
+  // appended), and the checksums of the bands are combined at the end. this
+  // costs a few bytes per band, and a little compression at the band edges
+  struct Band {
+    string compressed;
+    uLong adler;
+    size_t size;
+    int error;
+  };
+  thread_count = max<size_t>(min<size_t>(thread_count, h), 1);
+  vector<Band> bands(thread_count);
+  for_each_band(h, thread_count, [&](size_t y_start, size_t y_end) {
+    // band x starts at row (h * x) / thread_count, so this is x
+    Band& band = bands[(y_start * thread_count + h - 1) / h];
+    string filtered((y_end - y_start) * filtered_row_size, '\0');
+    vector<uint8_t> candidate(3 * w);
+    for (size_t y = y_start; y < y_end; y++) {
+      filter_png_row(pixels, w, y, reinterpret_cast<uint8_t*>(
+          filtered.data() + (y - y_start) * filtered_row_size),
+          candidate.data());
+    }
+    band.size = filtered.size();
+    band.adler = adler32(adler32(0, NULL, 0),
+        reinterpret_cast<const Bytef*>(filtered.data()), filtered.size());
+
+    // errors are reported after all the bands are done, since this may be
+    // running on another thread
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    band.error = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+        Z_DEFAULT_STRATEGY);
+    if (band.error != Z_OK) {
+      return;
+    }
+    bool is_last = (y_end == h);
+    band.compressed.resize(deflateBound(&zs, filtered.size()) + 16);
+    zs.next_in = reinterpret_cast<Bytef*>(filtered.data());
+    zs.avail_in = filtered.size();
+    zs.next_out = reinterpret_cast<Bytef*>(band.compressed.data());
+    zs.avail_out = band.compressed.size();
+    int error = deflate(&zs, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+    band.compressed.resize(zs.total_out);
+    band.error = ((error == (is_last ? Z_STREAM_END : Z_OK)) && !zs.avail_in)
+        ? Z_OK : (error == Z_OK) ? Z_BUF_ERROR : error;
+    deflateEnd(&zs);
+  });
+
+  string idat("\x78\x9C", 2);
+  uLong adler = adler32(0, NULL, 0);
+  for (const auto& band : bands) {
+    if (band.error != Z_OK) {
+      throw runtime_error(string_printf("can\'t compress image (%d)", band.error));
+    }
+    idat += band.compressed;
+    adler = adler32_combine(adler, band.adler, band.size);
+  }
+  append_be32(idat, adler);
+
+  string ihdr;
+  append_be32(ihdr, w);
+  append_be32(ihdr, h);
+  ihdr += string("\x08\x02\x00\x00\x00", 5); // 8-bit RGB, not interlaced
+
+  string ret("\x89PNG\r\n\x1A\n", 8);
+  append_png_chunk(ret, "IHDR", ihdr);
+  append_png_chunk(ret, "IDAT", idat);
+  append_png_chunk(ret, "IEND", "");
+  return ret;
+}
+
+
+
+string encode_frame(const Image& img, OutputFormat format,
+    size_t thread_count) {
+  switch (format) {
+    case OutputFormat::BMP:
+      return encode_bmp(img);
+    case OutputFormat::PNG:
+      return encode_png(img, thread_count);
+    case OutputFormat::Y4M:
+      return encode_y4m(img, thread_count);
+    case OutputFormat::RAW:
+      return encode_raw(img);
+  }
+  throw logic_error("invalid output format");
+}
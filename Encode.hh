@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <phosg/Image.hh>
+#include <string>
+
+
+// The formats that images can be written in:
+// - bmp: Windows bitmap files. Videos are written as a sequence of them.
+// - png: PNG files, compressed in row bands in parallel.
+// - y4m: a YUV4MPEG2 stream (4:2:0, BT.601), which video encoders (e.g.
+//   ffmpeg) can read directly without converting colors themselves. Videos
+//   are written as one stream.
+// - raw: 8-bit RGB pixels, with a one-line header ("zroot-rgb24 W H") at the
+//   start of the stream and nothing between frames. Videos are written as one
+//   stream.
+enum class OutputFormat {
+  BMP = 0,
+  PNG,
+  Y4M,
+  RAW,
+};
+
+// throws invalid_argument if the name isn't one of the above
+OutputFormat output_format_for_name(const char* name);
+const char* name_for_output_format(OutputFormat format);
+// returns the format whose name is filename's extension, or default_format if
+// there isn't one
+OutputFormat output_format_for_filename(const std::string& filename,
+    OutputFormat default_format);
+
+// returns true if all the frames of a video go in one stream in this format
+// (with encode_stream_header at the beginning), or false if each frame is a
+// complete file by itself
+bool is_stream_output_format(OutputFormat format);
+
+// returns the data that goes at the beginning of a stream of w x h frames
+// (which is empty for formats that aren't streams). frame_rate is only used
+// for y4m
+std::string encode_stream_header(OutputFormat format, size_t w, size_t h,
+    uint64_t frame_rate);
+
+// returns one frame in this format. the work is split up among thread_count
+// threads, for the formats that can be split
+std::string encode_frame(const Image& img, OutputFormat format,
+    size_t thread_count = 1);
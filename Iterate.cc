@@ -1,51 +1,286 @@
 #include "Iterate.hh"
 
 #include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
 
 #include "Complex.hh"
+#include "IterateSIMD.hh"
+#include "Polynomial.hh"
+#include "Roots.hh"
 
 using namespace std;
 
 
 static const complex zero = {0, 0};
 
-#ifndef AMD64
-static complex root_iterate(const vector<complex>& coeffs,
-    const complex& guess) {
-
-  complex numer(0, 0);
-  complex denom(0, 0);
-
-  complex guess_powers[coeffs.size()];
-  guess_powers[0].real = 1;
-  guess_powers[0].imag = 0;
-  for (size_t x = 1; x < coeffs.size(); x++) {
-    guess_powers[x] = guess_powers[x - 1] * guess;
-  }
-
-  int64_t degree = static_cast<int64_t>(coeffs.size() - 1);
-  for (ssize_t x = 0; x < static_cast<ssize_t>(coeffs.size()); x++) {
-    numer = numer + (guess_powers[degree - x] * coeffs[x]) * (degree - x - 1);
-    denom = denom + (guess_powers[degree - x - 1] * coeffs[x]) * (degree - x);
-  }
-  return (numer / denom);
-}
-#endif
 
-
-complex root(const vector<complex>& coeffs, const complex& guess,
-    double precision, size_t* max) {
+complex root(const Polynomial& poly, const complex& guess, double precision,
+    size_t* max) {
 
   complex this_guess = guess;
   complex last(0, 0);
   do {
     last = this_guess;
-#ifdef AMD64
-    root_iterate_asm(coeffs.data(), coeffs.size(), &this_guess, &this_guess);
+#if defined(__x86_64__)
+    if (get_iteration_kernel() == IterationKernel::ASM) {
+      root_iterate_asm(poly.get_coeffs().data(), poly.get_coeffs().size(),
+          &this_guess, &this_guess);
+    } else {
+      this_guess -= poly.step(this_guess);
+    }
 #else
-    this_guess = root_iterate(coeffs, this_guess);
+    this_guess -= poly.step(this_guess);
 #endif
     (*max)--;
   } while (!last.equal(this_guess, precision) && (*max));
   return *max ? this_guess : zero;
 }
+
+
+// the portable kernels are the vector kernels with one lane
+namespace {
+
+template <typename ValueT>
+struct ScalarOps {
+  using T = ValueT;
+  using V = ValueT;
+  static constexpr size_t lanes = 1;
+
+  static inline V set1(T v) { return v; }
+  static inline V load(const T* p) { return *p; }
+  static inline void store(T* p, V v) { *p = v; }
+  static inline V add(V a, V b) { return a + b; }
+  static inline V sub(V a, V b) { return a - b; }
+  static inline V mul(V a, V b) { return a * b; }
+  static inline V div(V a, V b) { return a / b; }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return a * b + c; }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return c - a * b; }
+
+  static inline V abs(V a) { return fabs(a); }
+  static inline uint32_t lt_bits(V a, V b) { return a < b; }
+  static inline V select_lt(V a, V b, V x, V y) { return (a < b) ? x : y; }
+};
+
+} // namespace
+
+#if defined(__x86_64__)
+
+// the assembly kernel only does one step at a time, so it does one point at a
+// time, with the same rules for when each point is done as the vector kernels
+static void root_batch_asm(const Polynomial& poly, const SplitRoots& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  const auto& coeffs = poly.get_coeffs();
+  double cycle_tolerance = cycle_tolerance_factor * precision;
+  double cycle_tolerance2 = cycle_tolerance * cycle_tolerance;
+  for (size_t z = 0; z < n; z++) {
+    complex guess(re[z], im[z]);
+    complex saved = guess;
+    size_t save_at = 1;
+    size_t depth = 0;
+    for (;;) {
+      complex next;
+      root_iterate_asm(coeffs.data(), coeffs.size(), &guess, &next);
+      double step_r = guess.real - next.real;
+      double step_i = guess.imag - next.imag;
+      guess = next;
+      depth++;
+
+      bool converged = (fabs(step_r) < precision) && (fabs(step_i) < precision);
+      double step2 = step_r * step_r + step_i * step_i;
+      ssize_t disk_root = -1;
+      if (step2 < 4 * roots.max_radius2) {
+        for (size_t x = 0; x < roots.count; x++) {
+          double diff_r = guess.real - roots.real[x];
+          double diff_i = guess.imag - roots.imag[x];
+          if (diff_r * diff_r + diff_i * diff_i < roots.radius2[x]) {
+            disk_root = x;
+            break;
+          }
+        }
+      }
+
+      if (disk_root >= 0) {
+        if (!converged) {
+          depth += 1 + remaining_steps_simd(roots, disk_root, guess.real,
+              guess.imag, precision, max_iterations);
+          depth = min(depth, max_iterations);
+        }
+        out_root[z] = (depth < max_iterations) ? disk_root : -1;
+        break;
+      }
+
+      double back_r = guess.real - saved.real;
+      double back_i = guess.imag - saved.imag;
+      if ((back_r * back_r + back_i * back_i < cycle_tolerance2) &&
+          !(step2 < cycle_tolerance2)) {
+        out_root[z] = -3;
+        break;
+      }
+      if (depth >= save_at) {
+        saved = guess;
+        save_at *= 2;
+      }
+
+      if (converged || (depth >= max_iterations)) {
+        out_root[z] = (depth < max_iterations)
+            ? find_root_simd(roots, guess.real, guess.imag) : -1;
+        break;
+      }
+    }
+    out_depth[z] = depth;
+  }
+}
+
+#endif
+
+const char* name_for_iteration_kernel(IterationKernel kernel) {
+  switch (kernel) {
+    case IterationKernel::SCALAR:
+      return "scalar";
+    case IterationKernel::AVX2:
+      return "avx2";
+    case IterationKernel::AVX512:
+      return "avx512";
+    case IterationKernel::ASM:
+      return "asm";
+  }
+  return "unknown";
+}
+
+IterationKernel iteration_kernel_for_name(const char* name) {
+  for (auto kernel : {IterationKernel::SCALAR, IterationKernel::ASM,
+      IterationKernel::AVX2, IterationKernel::AVX512}) {
+    if (!strcmp(name, name_for_iteration_kernel(kernel))) {
+      return kernel;
+    }
+  }
+  throw invalid_argument(string("unknown kernel: ") + name);
+}
+
+bool iteration_kernel_is_supported(IterationKernel kernel) {
+  switch (kernel) {
+    case IterationKernel::SCALAR:
+      return true;
+#if defined(__x86_64__)
+    case IterationKernel::AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case IterationKernel::AVX512:
+      return __builtin_cpu_supports("avx512f");
+    case IterationKernel::ASM:
+      return __builtin_cpu_supports("sse3");
+#endif
+    default:
+      return false;
+  }
+}
+
+vector<IterationKernel> supported_iteration_kernels() {
+  vector<IterationKernel> ret;
+  for (auto kernel : {IterationKernel::SCALAR, IterationKernel::ASM,
+      IterationKernel::AVX2, IterationKernel::AVX512}) {
+    if (iteration_kernel_is_supported(kernel)) {
+      ret.emplace_back(kernel);
+    }
+  }
+  return ret;
+}
+
+IterationKernel default_iteration_kernel() {
+  for (auto kernel : {IterationKernel::AVX512, IterationKernel::AVX2}) {
+    if (iteration_kernel_is_supported(kernel)) {
+      return kernel;
+    }
+  }
+  return IterationKernel::SCALAR;
+}
+
+static atomic<IterationKernel>& current_iteration_kernel() {
+  static atomic<IterationKernel> kernel(default_iteration_kernel());
+  return kernel;
+}
+
+IterationKernel get_iteration_kernel() {
+  return current_iteration_kernel().load(memory_order_relaxed);
+}
+
+void set_iteration_kernel(IterationKernel kernel) {
+  if (!iteration_kernel_is_supported(kernel)) {
+    throw invalid_argument(string("this CPU does not support the ") +
+        name_for_iteration_kernel(kernel) + " kernel");
+  }
+  current_iteration_kernel().store(kernel, memory_order_relaxed);
+}
+
+void root_batch(const Polynomial& poly, const RootSet& roots, const double* re,
+    const double* im, size_t n, double precision, size_t max_iterations,
+    ssize_t* out_root, size_t* out_depth) {
+  switch (get_iteration_kernel()) {
+#if defined(__x86_64__)
+    case IterationKernel::AVX512:
+      root_batch_avx512(poly.split(), roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+    case IterationKernel::AVX2:
+      root_batch_avx2(poly.split(), roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+    case IterationKernel::ASM:
+      root_batch_asm(poly, roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+#endif
+    default:
+      root_batch_simd<ScalarOps<double>>(poly.split(), roots.split(), re, im,
+          n, precision, max_iterations, out_root, out_depth);
+  }
+}
+
+void root_batch_float(const Polynomial& poly, const RootSet& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  switch (get_iteration_kernel()) {
+#if defined(__x86_64__)
+    case IterationKernel::AVX512:
+      root_batch_float_avx512(poly.split(), roots.split(), re, im, n,
+          precision, max_iterations, out_root, out_depth);
+      break;
+    case IterationKernel::AVX2:
+      root_batch_float_avx2(poly.split(), roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+#endif
+    default:
+      root_batch_float_simd<ScalarOps<float>>(poly.split(), roots.split(), re,
+          im, n, precision, max_iterations, out_root, out_depth);
+  }
+}
+
+void root_batch_dd(const Polynomial& poly, const RootSet& roots,
+    const DoubleDouble* re, const DoubleDouble* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  // there's no assembly version of this, so ASM uses the scalar kernel
+  switch (get_iteration_kernel()) {
+#if defined(__x86_64__)
+    case IterationKernel::AVX512:
+      root_batch_dd_avx512(poly.split(), roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+    case IterationKernel::AVX2:
+      root_batch_dd_avx2(poly.split(), roots.split(), re, im, n, precision,
+          max_iterations, out_root, out_depth);
+      break;
+#endif
+    default:
+      root_batch_simd<DoubleDoubleOps<ScalarOps<double>, false>>(poly.split(),
+          roots.split(), re, im, n, precision, max_iterations, out_root,
+          out_depth);
+  }
+}
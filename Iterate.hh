@@ -3,14 +3,111 @@
 #include <vector>
 
 #include "Complex.hh"
+#include "DoubleDouble.hh"
+#include "Polynomial.hh"
+#include "Roots.hh"
 
 
-complex root(const std::vector<complex>& coeffs, const complex& guess,
-    double precision, size_t* max);
+complex root(const Polynomial& poly, const complex& guess, double precision,
+    size_t* max);
 
-// On amd64 there's an optimized assembly version of this code that's a bit
-// faster
-#ifdef AMD64
+// The implementations of root_batch. By default the fastest one that the CPU
+// supports is used (never ASM, which is slower than the portable scalar kernel
+// and is only kept for comparison), but any supported one can be chosen
+// instead. They all give the same results, except that the ones that use
+// fused multiply-adds (or, for ASM, compute each step differently) may differ
+// slightly for points near basin boundaries.
+enum class IterationKernel {
+  SCALAR = 0,
+  AVX2,
+  AVX512,
+  // the SSE3 assembly step function in Iterate-amd64.S, one point at a time
+  ASM,
+};
+
+const char* name_for_iteration_kernel(IterationKernel kernel);
+// throws invalid_argument if the name isn't one of the kernels' names (the
+// kernel may still be unsupported by this CPU)
+IterationKernel iteration_kernel_for_name(const char* name);
+bool iteration_kernel_is_supported(IterationKernel kernel);
+// returns all the kernels this CPU supports. the scalar kernel is always first,
+// and the vector kernels are last, slowest first
+std::vector<IterationKernel> supported_iteration_kernels();
+// the kernel that's used if set_iteration_kernel isn't called
+IterationKernel default_iteration_kernel();
+IterationKernel get_iteration_kernel();
+// throws if the CPU doesn't support the kernel. this affects all threads, so
+// it shouldn't be called while rendering
+void set_iteration_kernel(IterationKernel kernel);
+
+// Runs Newton's method from n starting points at once, using the current
+// iteration kernel. The real and imaginary parts of the points are given
+// in separate arrays. Each point is done when it converges (as in root()),
+// when it enters one of the convergence disks in roots, or when it's caught in
+// an attracting cycle (see IterateSIMD.hh). On return, out_root contains the
+// index in roots of the root each point reached (or -1 if it didn't converge
+// to any of them, or -3 if it was caught in a cycle) and out_depth contains the
+// number of iterations used for each point.
+void root_batch(const Polynomial& poly, const RootSet& roots, const double* re,
+    const double* im, size_t n, double precision, size_t max_iterations,
+    ssize_t* out_root, size_t* out_depth);
+
+// Like root_batch, but iterates in single precision, which processes twice as
+// many points at once with the vector kernels. A point only counts as reaching
+// a root when it comes within half the radius of that root's convergence disk,
+// which is far enough inside that rounding errors can't have put it in the
+// wrong one. Points that don't converge within max_iterations get root -1 (as
+// in root_batch), and points caught in cycles get root -3. Points whose results
+// can't be trusted (those that converge without entering a disk, that
+// overflow, or that converge too close to the iteration limit) get root -2,
+// and should be computed again with root_batch. All points get root -2 if the
+// polynomial's degree is too large for the float kernels. The depths of points that
+// reach a root are within about one iteration of root_batch's.
+void root_batch_float(const Polynomial& poly, const RootSet& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth);
+
+// Like root_batch, but the points are given in double-double precision and are
+// iterated in it, for windows so small that neighboring pixels' coordinates
+// can't be told apart as doubles. This is much slower than root_batch.
+void root_batch_dd(const Polynomial& poly, const RootSet& roots,
+    const DoubleDouble* re, const DoubleDouble* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth);
+
+// The vectorized kernels behind root_batch, root_batch_float and
+// root_batch_dd. These are built with different instruction set flags and must
+// only be called if the CPU supports them.
+#if defined(__x86_64__)
+
+void root_batch_avx2(const SplitCoefficients& coeffs, const SplitRoots& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth);
+void root_batch_avx512(const SplitCoefficients& coeffs, const SplitRoots& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth);
+void root_batch_float_avx2(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth);
+void root_batch_float_avx512(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth);
+void root_batch_dd_avx2(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const DoubleDouble* re, const DoubleDouble* im,
+    size_t n, double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth);
+void root_batch_dd_avx512(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const DoubleDouble* re, const DoubleDouble* im,
+    size_t n, double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth);
+
+#endif
+
+// On amd64 there's an assembly version of one Newton step, used by the ASM
+// kernel. It returns guess - p(guess) / p'(guess) in result; coeffs must be
+// 16-byte aligned.
+#if defined(__x86_64__)
 
 extern "C" {
 
@@ -0,0 +1,88 @@
+// This file is compiled with -mavx2 -mfma; see IterateSIMD.hh for the rules
+// that apply to code in here.
+
+#include <immintrin.h>
+
+#include "Iterate.hh"
+#include "IterateSIMD.hh"
+
+
+namespace {
+
+struct AVX2Ops {
+  using T = double;
+  using V = __m256d;
+  static constexpr size_t lanes = 4;
+
+  static inline V set1(double v) { return _mm256_set1_pd(v); }
+  static inline V load(const double* p) { return _mm256_load_pd(p); }
+  static inline void store(double* p, V v) { _mm256_store_pd(p, v); }
+  static inline V add(V a, V b) { return _mm256_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_pd(a, b); }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return _mm256_fnmadd_pd(a, b, c); }
+
+  static inline V abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+  static inline uint32_t lt_bits(V a, V b) {
+    return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+  }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm256_blendv_pd(y, x, _mm256_cmp_pd(a, b, _CMP_LT_OQ));
+  }
+};
+
+struct AVX2FloatOps {
+  using T = float;
+  using V = __m256;
+  static constexpr size_t lanes = 8;
+
+  static inline V set1(float v) { return _mm256_set1_ps(v); }
+  static inline V load(const float* p) { return _mm256_load_ps(p); }
+  static inline void store(float* p, V v) { _mm256_store_ps(p, v); }
+  static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return _mm256_fnmadd_ps(a, b, c); }
+
+  static inline V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+  static inline uint32_t lt_bits(V a, V b) {
+    return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+};
+
+} // namespace
+
+
+void root_batch_avx2(const SplitCoefficients& coeffs, const SplitRoots& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  root_batch_simd<AVX2Ops>(coeffs, roots, re, im, n, precision, max_iterations,
+      out_root, out_depth);
+}
+
+void root_batch_float_avx2(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  root_batch_float_simd<PairOps<AVX2FloatOps>>(coeffs, roots, re, im, n, precision,
+      max_iterations, out_root, out_depth);
+}
+
+void root_batch_dd_avx2(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const DoubleDouble* re, const DoubleDouble* im,
+    size_t n, double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  root_batch_simd<DoubleDoubleOps<AVX2Ops, true>>(coeffs, roots, re, im, n,
+      precision, max_iterations, out_root, out_depth);
+}
@@ -0,0 +1,88 @@
+// This file is compiled with -mavx512f -mfma; see IterateSIMD.hh for the rules
+// that apply to code in here.
+
+#include <immintrin.h>
+
+#include "Iterate.hh"
+#include "IterateSIMD.hh"
+
+
+namespace {
+
+struct AVX512Ops {
+  using T = double;
+  using V = __m512d;
+  static constexpr size_t lanes = 8;
+
+  static inline V set1(double v) { return _mm512_set1_pd(v); }
+  static inline V load(const double* p) { return _mm512_load_pd(p); }
+  static inline void store(double* p, V v) { _mm512_store_pd(p, v); }
+  static inline V add(V a, V b) { return _mm512_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_pd(a, b); }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return _mm512_fnmadd_pd(a, b, c); }
+
+  static inline V abs(V a) { return _mm512_abs_pd(a); }
+  static inline uint32_t lt_bits(V a, V b) {
+    return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+  }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ), y, x);
+  }
+};
+
+struct AVX512FloatOps {
+  using T = float;
+  using V = __m512;
+  static constexpr size_t lanes = 16;
+
+  static inline V set1(float v) { return _mm512_set1_ps(v); }
+  static inline V load(const float* p) { return _mm512_load_ps(p); }
+  static inline void store(float* p, V v) { _mm512_store_ps(p, v); }
+  static inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_ps(a, b); }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return _mm512_fnmadd_ps(a, b, c); }
+
+  static inline V abs(V a) { return _mm512_abs_ps(a); }
+  static inline uint32_t lt_bits(V a, V b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+  }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), y, x);
+  }
+};
+
+} // namespace
+
+
+void root_batch_avx512(const SplitCoefficients& coeffs, const SplitRoots& roots,
+    const double* re, const double* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  root_batch_simd<AVX512Ops>(coeffs, roots, re, im, n, precision, max_iterations,
+      out_root, out_depth);
+}
+
+void root_batch_float_avx512(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  root_batch_float_simd<PairOps<AVX512FloatOps>>(coeffs, roots, re, im, n, precision,
+      max_iterations, out_root, out_depth);
+}
+
+void root_batch_dd_avx512(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const DoubleDouble* re, const DoubleDouble* im,
+    size_t n, double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  root_batch_simd<DoubleDoubleOps<AVX512Ops, true>>(coeffs, roots, re, im, n,
+      precision, max_iterations, out_root, out_depth);
+}
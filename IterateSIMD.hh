@@ -0,0 +1,722 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
+#include "DoubleDouble.hh"
+#include "Polynomial.hh"
+#include "Roots.hh"
+
+// Generic lane-parallel Newton iteration, shared by the per-ISA kernels. Each
+// of those files is compiled with different instruction set flags, so nothing
+// here may have external linkage - otherwise the linker could choose an AVX
+// copy of some function for use on a machine that doesn't support it. For the
+// same reason, the kernels only deal with raw arrays (no std containers), and
+// the coefficients come in as a SplitCoefficients.
+//
+// An Ops class provides the vector type V, the type T of its elements (double,
+// float or DoubleDouble), the number of lanes it holds, and the arithmetic
+// primitives. lt_bits(a, b) returns a bitmask of the lanes in which a < b, and
+// select_lt(a, b, x, y) returns x in those lanes and y in the others.
+//
+// A lane is done with its point when the last step was smaller than precision
+// in both components, when it hits the iteration limit, when the point is
+// inside one of the roots' convergence disks, or when it's caught in a cycle.
+//
+// Cycles are found with Brent's method: each lane remembers where its point
+// was when its iteration count last reached a power of 2, and the point is in
+// a cycle if it comes back to within cycle_tolerance_factor * precision of
+// there while its steps are still larger than that. (Points converging to a
+// root take steps about as large as their distance from it, so they can't
+// look like cycles.) This finds cycles of any period within about twice the
+// number of iterations it takes to settle into them.
+
+namespace {
+
+constexpr double cycle_tolerance_factor = 1000.0;
+
+// SplitCoefficients converted to single precision, for the float kernels
+struct FloatCoefficients {
+  const float* real;
+  const float* imag;
+  const float* deriv_real;
+  const float* deriv_imag;
+  size_t degree;
+};
+
+// one step of Horner's method for p and p' together: p = p * z + c, and the
+// same for p' (which has one fewer coefficient). CoeffsT is SplitCoefficients
+// or FloatCoefficients, matching Ops::T
+template <typename Ops, size_t Degree, size_t I, typename CoeffsT>
+inline void horner_step_simd(const CoeffsT& c, typename Ops::V zr,
+    typename Ops::V zi, typename Ops::V& pr, typename Ops::V& pi,
+    typename Ops::V& dr, typename Ops::V& di) {
+  using V = typename Ops::V;
+  V new_pr = Ops::fmadd(pr, zr, Ops::fnmadd(pi, zi, Ops::set1(c.real[I + 1])));
+  V new_pi = Ops::fmadd(pr, zi, Ops::fmadd(pi, zr, Ops::set1(c.imag[I + 1])));
+  pr = new_pr;
+  pi = new_pi;
+  if constexpr (I + 1 < Degree) {
+    V new_dr = Ops::fmadd(dr, zr, Ops::fnmadd(di, zi, Ops::set1(c.deriv_real[I + 1])));
+    V new_di = Ops::fmadd(dr, zi, Ops::fmadd(di, zr, Ops::set1(c.deriv_imag[I + 1])));
+    dr = new_dr;
+    di = new_di;
+  }
+}
+
+template <typename Ops, size_t Degree, typename CoeffsT, size_t... I>
+inline void evaluate_unrolled_simd(const CoeffsT& c,
+    typename Ops::V zr, typename Ops::V zi, typename Ops::V& pr,
+    typename Ops::V& pi, typename Ops::V& dr, typename Ops::V& di,
+    std::index_sequence<I...>) {
+  (horner_step_simd<Ops, Degree, I, CoeffsT>(c, zr, zi, pr, pi, dr, di), ...);
+}
+
+// evaluates p(z) and p'(z). if Degree is nonzero, the loop is unrolled for
+// that degree; otherwise, it comes from the coefficients at runtime
+template <typename Ops, size_t Degree, typename CoeffsT>
+inline void evaluate_simd(const CoeffsT& c, typename Ops::V zr,
+    typename Ops::V zi, typename Ops::V& pr, typename Ops::V& pi,
+    typename Ops::V& dr, typename Ops::V& di) {
+  using V = typename Ops::V;
+  pr = Ops::set1(c.real[0]);
+  pi = Ops::set1(c.imag[0]);
+  dr = Ops::set1(c.deriv_real[0]);
+  di = Ops::set1(c.deriv_imag[0]);
+  if constexpr (Degree != 0) {
+    evaluate_unrolled_simd<Ops, Degree, CoeffsT>(c, zr, zi, pr, pi, dr, di,
+        std::make_index_sequence<Degree>());
+  } else {
+    for (size_t x = 1; x <= c.degree; x++) {
+      V new_pr = Ops::fmadd(pr, zr, Ops::fnmadd(pi, zi, Ops::set1(c.real[x])));
+      V new_pi = Ops::fmadd(pr, zi, Ops::fmadd(pi, zr, Ops::set1(c.imag[x])));
+      pr = new_pr;
+      pi = new_pi;
+      if (x < c.degree) {
+        V new_dr = Ops::fmadd(dr, zr, Ops::fnmadd(di, zi, Ops::set1(c.deriv_real[x])));
+        V new_di = Ops::fmadd(dr, zi, Ops::fmadd(di, zr, Ops::set1(c.deriv_imag[x])));
+        dr = new_dr;
+        di = new_di;
+      }
+    }
+  }
+}
+
+// the value of one lane as a double, for the parts of the kernels that work
+// on one lane at a time
+inline double lane_value(double v) {
+  return v;
+}
+inline double lane_value(const DoubleDouble& v) {
+  return v.hi;
+}
+// and the reverse
+template <typename T>
+inline T from_lane_value(double v) {
+  return v;
+}
+template <>
+inline DoubleDouble from_lane_value<DoubleDouble>(double v) {
+  return {v, 0.0};
+}
+
+// returns the index of the root within detect_precision of z, or -1
+inline ssize_t find_root_simd(const SplitRoots& roots, double zr, double zi) {
+  for (size_t x = 0; x < roots.count; x++) {
+    double dr = zr - roots.real[x], di = zi - roots.imag[x];
+    if ((dr < roots.detect_precision) && (dr > -roots.detect_precision) &&
+        (di < roots.detect_precision) && (di > -roots.detect_precision)) {
+      return x;
+    }
+  }
+  return -1;
+}
+
+// returns the number of steps a point that's in the convergence disk of root x
+// (but hasn't converged yet) would take to converge, not counting the step
+// that would detect convergence
+inline size_t remaining_steps_simd(const SplitRoots& roots, size_t x, double zr,
+    double zi, double precision, size_t max_steps) {
+  double diff_r = zr - roots.real[x], diff_i = zi - roots.imag[x];
+  double error = sqrt(diff_r * diff_r + diff_i * diff_i);
+  size_t steps = 0;
+  while ((error >= precision) && (steps < max_steps)) {
+    error = error * error * (roots.rate2[x] + roots.rate3[x] * error);
+    steps++;
+  }
+  return steps;
+}
+
+template <typename Ops, size_t Degree>
+void root_batch_simd_degree(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const typename Ops::T* re,
+    const typename Ops::T* im, size_t n, double precision,
+    size_t max_iterations, ssize_t* out_root, size_t* out_depth) {
+  using V = typename Ops::V;
+  using T = typename Ops::T;
+  constexpr size_t lanes = Ops::lanes;
+  constexpr uint32_t all_lanes = (1 << lanes) - 1;
+
+  const V prec = Ops::set1(precision);
+  const V max_count = Ops::set1(static_cast<double>(max_iterations));
+  const V one = Ops::set1(1.0);
+  // a point in a convergence disk of radius r takes a step of at most 2r, so
+  // there's no need to look for the disks until the step is that small
+  const V disk_check_step2 = Ops::set1(4 * roots.max_radius2);
+  const double cycle_tolerance = cycle_tolerance_factor * precision;
+  const V cycle_tolerance2 = Ops::set1(cycle_tolerance * cycle_tolerance);
+
+  // each lane works on one pixel at a time; when a pixel is done, the lane
+  // immediately picks up the next one, so lanes don't sit idle waiting for the
+  // slowest pixel in a group
+  alignas(64) T zr_a[lanes];
+  alignas(64) T zi_a[lanes];
+  alignas(64) T count_a[lanes];
+  // for cycle detection: where each lane's point was at its last checkpoint,
+  // and the count at which it will next be saved
+  alignas(64) T saved_r_a[lanes];
+  alignas(64) T saved_i_a[lanes];
+  alignas(64) T save_at_a[lanes];
+  size_t lane_pixel[lanes];
+  ssize_t lane_root[lanes];
+  size_t next_pixel = 0;
+  uint32_t active = 0;
+  for (size_t l = 0; l < lanes; l++) {
+    if (next_pixel < n) {
+      zr_a[l] = re[next_pixel];
+      zi_a[l] = im[next_pixel];
+      lane_pixel[l] = next_pixel++;
+      active |= (1 << l);
+    } else {
+      zr_a[l] = T{};
+      zi_a[l] = T{};
+      lane_pixel[l] = 0;
+    }
+    count_a[l] = T{};
+    saved_r_a[l] = zr_a[l];
+    saved_i_a[l] = zi_a[l];
+    save_at_a[l] = from_lane_value<T>(1.0);
+    lane_root[l] = -1;
+  }
+
+  V zr = Ops::load(zr_a);
+  V zi = Ops::load(zi_a);
+  V count = Ops::load(count_a);
+  V saved_r = Ops::load(saved_r_a);
+  V saved_i = Ops::load(saved_i_a);
+  V save_at = Ops::load(save_at_a);
+  while (active) {
+    V pr, pi, dr, di;
+    evaluate_simd<Ops, Degree>(coeffs, zr, zi, pr, pi, dr, di);
+
+    // step = p(z) / p'(z); z -= step
+    V denom = Ops::fmadd(dr, dr, Ops::mul(di, di));
+    V step_r = Ops::div(Ops::fmadd(pr, dr, Ops::mul(pi, di)), denom);
+    V step_i = Ops::div(Ops::fnmadd(pr, di, Ops::mul(pi, dr)), denom);
+    zr = Ops::sub(zr, step_r);
+    zi = Ops::sub(zi, step_i);
+    count = Ops::add(count, one);
+
+    uint32_t converged = Ops::lt_bits(Ops::abs(step_r), prec) &
+        Ops::lt_bits(Ops::abs(step_i), prec);
+    uint32_t exhausted = all_lanes & ~Ops::lt_bits(count, max_count);
+
+    // only lanes that pass the step check may stop in a disk, so the result
+    // for each pixel doesn't depend on which other pixels are in its batch
+    uint32_t in_disk = 0;
+    V step2 = Ops::fmadd(step_r, step_r, Ops::mul(step_i, step_i));
+    uint32_t disk_check = Ops::lt_bits(step2, disk_check_step2) & active;
+    if (disk_check) {
+      for (size_t x = 0; x < roots.count; x++) {
+        V diff_r = Ops::sub(zr, Ops::set1(roots.real[x]));
+        V diff_i = Ops::sub(zi, Ops::set1(roots.imag[x]));
+        V dist2 = Ops::fmadd(diff_r, diff_r, Ops::mul(diff_i, diff_i));
+        uint32_t new_in_disk = Ops::lt_bits(dist2, Ops::set1(roots.radius2[x])) &
+            disk_check & ~in_disk;
+        for (size_t l = 0; new_in_disk >> l; l++) {
+          if (new_in_disk & (1 << l)) {
+            lane_root[l] = x;
+          }
+        }
+        in_disk |= new_in_disk;
+      }
+    }
+
+    V back_r = Ops::sub(zr, saved_r);
+    V back_i = Ops::sub(zi, saved_i);
+    V back2 = Ops::fmadd(back_r, back_r, Ops::mul(back_i, back_i));
+    uint32_t cycling = Ops::lt_bits(back2, cycle_tolerance2) &
+        ~Ops::lt_bits(step2, cycle_tolerance2);
+    saved_r = Ops::select_lt(count, save_at, saved_r, zr);
+    saved_i = Ops::select_lt(count, save_at, saved_i, zi);
+    save_at = Ops::select_lt(count, save_at, save_at, Ops::add(save_at, save_at));
+
+    uint32_t done = (converged | exhausted | in_disk | cycling) & active;
+    if (!done) {
+      continue;
+    }
+
+    Ops::store(zr_a, zr);
+    Ops::store(zi_a, zi);
+    Ops::store(count_a, count);
+    Ops::store(saved_r_a, saved_r);
+    Ops::store(saved_i_a, saved_i);
+    Ops::store(save_at_a, save_at);
+    for (size_t l = 0; l < lanes; l++) {
+      if (!(done & (1 << l))) {
+        continue;
+      }
+
+      // points that stopped early in a disk report the depth they would have
+      // converged at. like root(), a point that only converges at the
+      // iteration limit counts as not converging
+      size_t pixel = lane_pixel[l];
+      size_t depth = static_cast<size_t>(lane_value(count_a[l]));
+      if (in_disk & (1 << l)) {
+        if (!(converged & (1 << l))) {
+          depth += 1 + remaining_steps_simd(roots, lane_root[l],
+              lane_value(zr_a[l]), lane_value(zi_a[l]), precision,
+              max_iterations);
+          depth = (depth < max_iterations) ? depth : max_iterations;
+        }
+        out_root[pixel] = (depth < max_iterations) ? lane_root[l] : -1;
+      } else if (cycling & (1 << l)) {
+        out_root[pixel] = -3;
+      } else if (depth < max_iterations) {
+        out_root[pixel] = find_root_simd(roots, lane_value(zr_a[l]),
+            lane_value(zi_a[l]));
+      } else {
+        out_root[pixel] = -1;
+      }
+      out_depth[pixel] = depth;
+
+      if (next_pixel < n) {
+        zr_a[l] = re[next_pixel];
+        zi_a[l] = im[next_pixel];
+        lane_pixel[l] = next_pixel++;
+      } else {
+        active &= ~(1 << l);
+      }
+      count_a[l] = T{};
+      saved_r_a[l] = zr_a[l];
+      saved_i_a[l] = zi_a[l];
+      save_at_a[l] = from_lane_value<T>(1.0);
+      lane_root[l] = -1;
+    }
+    zr = Ops::load(zr_a);
+    zi = Ops::load(zi_a);
+    count = Ops::load(count_a);
+    saved_r = Ops::load(saved_r_a);
+    saved_i = Ops::load(saved_i_a);
+    save_at = Ops::load(save_at_a);
+  }
+}
+
+template <typename T>
+using RootBatchFunction = void (*)(const SplitCoefficients&,
+    const SplitRoots&, const T*, const T*, size_t, double, size_t, ssize_t*,
+    size_t*);
+
+// fns[d] is the kernel unrolled for degree d (fns[0] is the generic one)
+template <typename Ops, typename Degrees>
+struct RootBatchFunctions;
+template <typename Ops, size_t... Degrees>
+struct RootBatchFunctions<Ops, std::index_sequence<Degrees...>> {
+  static constexpr size_t count = sizeof...(Degrees) + 1;
+  static constexpr RootBatchFunction<typename Ops::T> fns[count] = {
+      &root_batch_simd_degree<Ops, 0>,
+      &root_batch_simd_degree<Ops, Degrees + 1>...};
+};
+
+template <typename Ops>
+void root_batch_simd(const SplitCoefficients& coeffs, const SplitRoots& roots,
+    const typename Ops::T* re, const typename Ops::T* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  using Functions = RootBatchFunctions<Ops,
+      std::make_index_sequence<Polynomial::MAX_UNROLLED_DEGREE>>;
+  auto fn = (coeffs.degree < Functions::count)
+      ? Functions::fns[coeffs.degree] : Functions::fns[0];
+  fn(coeffs, roots, re, im, n, precision, max_iterations, out_root, out_depth);
+}
+
+// Two vectors of Ops used as one vector with twice as many lanes. Evaluating
+// the polynomial is one long chain of dependent multiply-adds, so the kernels
+// spend most of their time waiting for results; with two independent chains,
+// the CPU can work on one while waiting for the other.
+template <typename Ops>
+struct PairOps {
+  using T = typename Ops::T;
+  struct V {
+    typename Ops::V lo, hi;
+  };
+  static constexpr size_t lanes = 2 * Ops::lanes;
+
+  static inline V set1(T v) { return {Ops::set1(v), Ops::set1(v)}; }
+  static inline V load(const T* p) {
+    return {Ops::load(p), Ops::load(p + Ops::lanes)};
+  }
+  static inline void store(T* p, V v) {
+    Ops::store(p, v.lo);
+    Ops::store(p + Ops::lanes, v.hi);
+  }
+  static inline V add(V a, V b) { return {Ops::add(a.lo, b.lo), Ops::add(a.hi, b.hi)}; }
+  static inline V sub(V a, V b) { return {Ops::sub(a.lo, b.lo), Ops::sub(a.hi, b.hi)}; }
+  static inline V mul(V a, V b) { return {Ops::mul(a.lo, b.lo), Ops::mul(a.hi, b.hi)}; }
+  static inline V div(V a, V b) { return {Ops::div(a.lo, b.lo), Ops::div(a.hi, b.hi)}; }
+  static inline V fmadd(V a, V b, V c) {
+    return {Ops::fmadd(a.lo, b.lo, c.lo), Ops::fmadd(a.hi, b.hi, c.hi)};
+  }
+  static inline V fnmadd(V a, V b, V c) {
+    return {Ops::fnmadd(a.lo, b.lo, c.lo), Ops::fnmadd(a.hi, b.hi, c.hi)};
+  }
+
+  static inline V abs(V a) { return {Ops::abs(a.lo), Ops::abs(a.hi)}; }
+  static inline uint32_t lt_bits(V a, V b) {
+    return Ops::lt_bits(a.lo, b.lo) | (Ops::lt_bits(a.hi, b.hi) << Ops::lanes);
+  }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return {Ops::select_lt(a.lo, b.lo, x.lo, y.lo),
+        Ops::select_lt(a.hi, b.hi, x.hi, y.hi)};
+  }
+};
+
+// Double-double arithmetic (see DoubleDouble.hh) on vectors of Ops, which must
+// have T = double. Each value is kept as two vectors, one with the high parts
+// and one with the low parts, and the arithmetic uses the usual error-free
+// transformations. If Fused is true, Ops::fmadd must be a fused multiply-add,
+// which makes the product's rounding error one instruction; otherwise it's
+// computed with Dekker's splitting. abs, lt_bits and select_lt only look at
+// the high parts, which is all the stopping tests need.
+template <typename Ops, bool Fused>
+struct DoubleDoubleOps {
+  using T = DoubleDouble;
+  struct V {
+    typename Ops::V hi, lo;
+  };
+  static constexpr size_t lanes = Ops::lanes;
+
+  static inline V set1(double v) { return {Ops::set1(v), Ops::set1(0.0)}; }
+  static inline V load(const T* p) {
+    alignas(64) double hi[lanes];
+    alignas(64) double lo[lanes];
+    for (size_t l = 0; l < lanes; l++) {
+      hi[l] = p[l].hi;
+      lo[l] = p[l].lo;
+    }
+    return {Ops::load(hi), Ops::load(lo)};
+  }
+  static inline void store(T* p, V v) {
+    alignas(64) double hi[lanes];
+    alignas(64) double lo[lanes];
+    Ops::store(hi, v.hi);
+    Ops::store(lo, v.lo);
+    for (size_t l = 0; l < lanes; l++) {
+      p[l].hi = hi[l];
+      p[l].lo = lo[l];
+    }
+  }
+
+  // s + e == a + b exactly
+  static inline V two_sum(typename Ops::V a, typename Ops::V b) {
+    auto s = Ops::add(a, b);
+    auto bb = Ops::sub(s, a);
+    auto e = Ops::add(Ops::sub(a, Ops::sub(s, bb)), Ops::sub(b, bb));
+    return {s, e};
+  }
+  // the same, but only if |a| >= |b|
+  static inline V quick_two_sum(typename Ops::V a, typename Ops::V b) {
+    auto s = Ops::add(a, b);
+    return {s, Ops::sub(b, Ops::sub(s, a))};
+  }
+  // p + e == a * b exactly
+  static inline V two_prod(typename Ops::V a, typename Ops::V b) {
+    auto p = Ops::mul(a, b);
+    if constexpr (Fused) {
+      return {p, Ops::fmadd(a, b, Ops::sub(Ops::set1(0.0), p))};
+    } else {
+      const auto splitter = Ops::set1(134217729.0); // 2^27 + 1
+      auto ta = Ops::mul(a, splitter);
+      auto a_hi = Ops::sub(ta, Ops::sub(ta, a));
+      auto a_lo = Ops::sub(a, a_hi);
+      auto tb = Ops::mul(b, splitter);
+      auto b_hi = Ops::sub(tb, Ops::sub(tb, b));
+      auto b_lo = Ops::sub(b, b_hi);
+      auto e = Ops::add(Ops::sub(Ops::mul(a_hi, b_hi), p), Ops::mul(a_hi, b_lo));
+      e = Ops::add(Ops::add(e, Ops::mul(a_lo, b_hi)), Ops::mul(a_lo, b_lo));
+      return {p, e};
+    }
+  }
+
+  static inline V add(V a, V b) {
+    V s = two_sum(a.hi, b.hi);
+    V t = two_sum(a.lo, b.lo);
+    s = quick_two_sum(s.hi, Ops::add(s.lo, t.hi));
+    return quick_two_sum(s.hi, Ops::add(s.lo, t.lo));
+  }
+  static inline V sub(V a, V b) {
+    const auto zero = Ops::set1(0.0);
+    return add(a, {Ops::sub(zero, b.hi), Ops::sub(zero, b.lo)});
+  }
+  static inline V mul(V a, V b) {
+    V p = two_prod(a.hi, b.hi);
+    auto cross = Ops::add(Ops::mul(a.hi, b.lo), Ops::mul(a.lo, b.hi));
+    return quick_two_sum(p.hi, Ops::add(p.lo, cross));
+  }
+  // long division: each quotient digit is the quotient of the high parts,
+  // and the next one comes from the remainder
+  static inline V div(V a, V b) {
+    auto q1 = Ops::div(a.hi, b.hi);
+    V r = sub(a, mul(b, {q1, Ops::set1(0.0)}));
+    auto q2 = Ops::div(r.hi, b.hi);
+    r = sub(r, mul(b, {q2, Ops::set1(0.0)}));
+    auto q3 = Ops::div(r.hi, b.hi);
+    V q = quick_two_sum(q1, q2);
+    return add(q, {q3, Ops::set1(0.0)});
+  }
+  // a * b + c
+  static inline V fmadd(V a, V b, V c) { return add(mul(a, b), c); }
+  // c - a * b
+  static inline V fnmadd(V a, V b, V c) { return sub(c, mul(a, b)); }
+
+  static inline V abs(V a) { return {Ops::abs(a.hi), Ops::set1(0.0)}; }
+  static inline uint32_t lt_bits(V a, V b) { return Ops::lt_bits(a.hi, b.hi); }
+  static inline V select_lt(V a, V b, V x, V y) {
+    return {Ops::select_lt(a.hi, b.hi, x.hi, y.hi),
+        Ops::select_lt(a.hi, b.hi, x.lo, y.lo)};
+  }
+};
+
+// The single-precision kernel for mixed-precision rendering (see
+// root_batch_float in Iterate.hh). It works like root_batch_simd_degree, but a
+// point only counts as reaching a root once it's within half the radius of its
+// convergence disk, so that small differences from the double-precision path
+// can't have put it in a different disk. Its depth is still predicted from
+// where it first entered the disk, as in the double-precision kernel, so the
+// depths usually match exactly. Points that don't converge get root -1, and
+// points that converge anywhere else or overflow get root -2, so they can be
+// done again in double precision. Points caught in cycles get root -3.
+template <typename Ops, size_t Degree>
+void root_batch_float_simd_degree(const FloatCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  using V = typename Ops::V;
+  using T = typename Ops::T;
+  constexpr size_t lanes = Ops::lanes;
+  constexpr uint32_t all_lanes = static_cast<uint32_t>((1ULL << lanes) - 1);
+
+  const V prec = Ops::set1(precision);
+  const V max_count = Ops::set1(static_cast<T>(max_iterations));
+  const V one = Ops::set1(1.0f);
+  const V max_step2 = Ops::set1(3.0e38f);
+  const V disk_check_step2 = Ops::set1(static_cast<T>(4 * roots.max_radius2));
+  const double cycle_tolerance = cycle_tolerance_factor * precision;
+  const V cycle_tolerance2 = Ops::set1(
+      static_cast<T>(cycle_tolerance * cycle_tolerance));
+
+  alignas(64) T zr_a[lanes];
+  alignas(64) T zi_a[lanes];
+  alignas(64) T count_a[lanes];
+  alignas(64) T saved_r_a[lanes];
+  alignas(64) T saved_i_a[lanes];
+  alignas(64) T save_at_a[lanes];
+  size_t lane_pixel[lanes];
+  ssize_t lane_root[lanes];
+  // the predicted depth of each lane's point, once it has entered a disk
+  size_t lane_depth[lanes];
+  size_t next_pixel = 0;
+  uint32_t active = 0;
+  uint32_t entered = 0;
+  for (size_t l = 0; l < lanes; l++) {
+    if (next_pixel < n) {
+      zr_a[l] = re[next_pixel];
+      zi_a[l] = im[next_pixel];
+      lane_pixel[l] = next_pixel++;
+      active |= (1U << l);
+    } else {
+      zr_a[l] = 0.0f;
+      zi_a[l] = 0.0f;
+      lane_pixel[l] = 0;
+    }
+    count_a[l] = 0.0f;
+    saved_r_a[l] = zr_a[l];
+    saved_i_a[l] = zi_a[l];
+    save_at_a[l] = 1.0f;
+    lane_root[l] = -1;
+    lane_depth[l] = 0;
+  }
+
+  V zr = Ops::load(zr_a);
+  V zi = Ops::load(zi_a);
+  V count = Ops::load(count_a);
+  V saved_r = Ops::load(saved_r_a);
+  V saved_i = Ops::load(saved_i_a);
+  V save_at = Ops::load(save_at_a);
+  while (active) {
+    V pr, pi, dr, di;
+    evaluate_simd<Ops, Degree>(coeffs, zr, zi, pr, pi, dr, di);
+
+    V denom = Ops::fmadd(dr, dr, Ops::mul(di, di));
+    V step_r = Ops::div(Ops::fmadd(pr, dr, Ops::mul(pi, di)), denom);
+    V step_i = Ops::div(Ops::fnmadd(pr, di, Ops::mul(pi, dr)), denom);
+    zr = Ops::sub(zr, step_r);
+    zi = Ops::sub(zi, step_i);
+    count = Ops::add(count, one);
+
+    // steps that are NaN or huge fail the first check. points that converge
+    // without entering a disk can't be classified reliably either
+    V step2 = Ops::fmadd(step_r, step_r, Ops::mul(step_i, step_i));
+    uint32_t unresolved = (all_lanes & ~Ops::lt_bits(step2, max_step2)) |
+        (Ops::lt_bits(Ops::abs(step_r), prec) &
+         Ops::lt_bits(Ops::abs(step_i), prec) & ~entered);
+    uint32_t exhausted = all_lanes & ~Ops::lt_bits(count, max_count);
+
+    uint32_t in_disk = 0;
+    uint32_t disk_check = Ops::lt_bits(step2, disk_check_step2) & active;
+    if (disk_check) {
+      Ops::store(zr_a, zr);
+      Ops::store(zi_a, zi);
+      Ops::store(count_a, count);
+      for (size_t x = 0; x < roots.count; x++) {
+        V diff_r = Ops::sub(zr, Ops::set1(static_cast<T>(roots.real[x])));
+        V diff_i = Ops::sub(zi, Ops::set1(static_cast<T>(roots.imag[x])));
+        V dist2 = Ops::fmadd(diff_r, diff_r, Ops::mul(diff_i, diff_i));
+        // a point that enters a disk never leaves it, so it can only be in
+        // the inner half of the disk it entered
+        uint32_t new_entered = Ops::lt_bits(dist2,
+            Ops::set1(static_cast<T>(roots.radius2[x]))) & disk_check & ~entered;
+        for (uint32_t bits = new_entered; bits; bits &= (bits - 1)) {
+          size_t l = __builtin_ctz(bits);
+          lane_root[l] = x;
+          lane_depth[l] = static_cast<size_t>(count_a[l]) + 1 +
+              remaining_steps_simd(roots, x, zr_a[l], zi_a[l], precision,
+                  max_iterations);
+        }
+        entered |= new_entered;
+        in_disk |= Ops::lt_bits(dist2,
+            Ops::set1(static_cast<T>(roots.radius2[x] / 4))) & disk_check & entered;
+      }
+    }
+
+    V back_r = Ops::sub(zr, saved_r);
+    V back_i = Ops::sub(zi, saved_i);
+    V back2 = Ops::fmadd(back_r, back_r, Ops::mul(back_i, back_i));
+    uint32_t cycling = Ops::lt_bits(back2, cycle_tolerance2) &
+        ~Ops::lt_bits(step2, cycle_tolerance2);
+    saved_r = Ops::select_lt(count, save_at, saved_r, zr);
+    saved_i = Ops::select_lt(count, save_at, saved_i, zi);
+    save_at = Ops::select_lt(count, save_at, save_at, Ops::add(save_at, save_at));
+
+    uint32_t done = (unresolved | exhausted | in_disk | cycling) & active;
+    if (!done) {
+      continue;
+    }
+
+    Ops::store(zr_a, zr);
+    Ops::store(zi_a, zi);
+    Ops::store(count_a, count);
+    Ops::store(saved_r_a, saved_r);
+    Ops::store(saved_i_a, saved_i);
+    Ops::store(save_at_a, save_at);
+    for (uint32_t bits = done; bits; bits &= (bits - 1)) {
+      size_t l = __builtin_ctz(bits);
+      size_t pixel = lane_pixel[l];
+      if (in_disk & (1U << l)) {
+        // the depth may be off by one, so a point that's that close to the
+        // iteration limit may or may not count as converging
+        size_t depth = lane_depth[l];
+        out_root[pixel] = (depth + 1 < max_iterations) ? lane_root[l] : -2;
+        out_depth[pixel] = depth;
+      } else if ((unresolved | entered) & (1U << l)) {
+        out_root[pixel] = -2;
+        out_depth[pixel] = 0;
+      } else if (cycling & (1U << l)) {
+        out_root[pixel] = -3;
+        out_depth[pixel] = static_cast<size_t>(count_a[l]);
+      } else {
+        out_root[pixel] = -1;
+        out_depth[pixel] = max_iterations;
+      }
+
+      if (next_pixel < n) {
+        zr_a[l] = re[next_pixel];
+        zi_a[l] = im[next_pixel];
+        lane_pixel[l] = next_pixel++;
+      } else {
+        active &= ~(1U << l);
+      }
+      count_a[l] = 0.0f;
+      saved_r_a[l] = zr_a[l];
+      saved_i_a[l] = zi_a[l];
+      save_at_a[l] = 1.0f;
+      lane_root[l] = -1;
+      entered &= ~(1U << l);
+    }
+    zr = Ops::load(zr_a);
+    zi = Ops::load(zi_a);
+    count = Ops::load(count_a);
+    saved_r = Ops::load(saved_r_a);
+    saved_i = Ops::load(saved_i_a);
+    save_at = Ops::load(save_at_a);
+  }
+}
+
+using RootBatchFloatFunction = void (*)(const FloatCoefficients&,
+    const SplitRoots&, const double*, const double*, size_t, double, size_t,
+    ssize_t*, size_t*);
+
+template <typename Ops, typename Degrees>
+struct RootBatchFloatFunctions;
+template <typename Ops, size_t... Degrees>
+struct RootBatchFloatFunctions<Ops, std::index_sequence<Degrees...>> {
+  static constexpr size_t count = sizeof...(Degrees) + 1;
+  static constexpr RootBatchFloatFunction fns[count] = {
+      &root_batch_float_simd_degree<Ops, 0>,
+      &root_batch_float_simd_degree<Ops, Degrees + 1>...};
+};
+
+// the largest degree the float kernels handle; the coefficients are converted
+// into arrays on the stack
+constexpr size_t max_float_degree = 0x100;
+
+template <typename Ops>
+void root_batch_float_simd(const SplitCoefficients& coeffs,
+    const SplitRoots& roots, const double* re, const double* im, size_t n,
+    double precision, size_t max_iterations, ssize_t* out_root,
+    size_t* out_depth) {
+  // too many coefficients to fit on the stack; send every point back to the
+  // double kernels
+  if (coeffs.degree >= max_float_degree) {
+    for (size_t z = 0; z < n; z++) {
+      out_root[z] = -2;
+      out_depth[z] = 0;
+    }
+    return;
+  }
+
+  // p' has one fewer coefficient than p (but always at least one)
+  float data[4][max_float_degree + 1];
+  for (size_t x = 0; x <= coeffs.degree; x++) {
+    data[0][x] = coeffs.real[x];
+    data[1][x] = coeffs.imag[x];
+  }
+  for (size_t x = 0; (x < coeffs.degree) || (x == 0); x++) {
+    data[2][x] = coeffs.deriv_real[x];
+    data[3][x] = coeffs.deriv_imag[x];
+  }
+  FloatCoefficients float_coeffs = {
+      data[0], data[1], data[2], data[3], coeffs.degree};
+
+  using Functions = RootBatchFloatFunctions<Ops,
+      std::make_index_sequence<Polynomial::MAX_UNROLLED_DEGREE>>;
+  auto fn = (coeffs.degree < Functions::count)
+      ? Functions::fns[coeffs.degree] : Functions::fns[0];
+  fn(float_coeffs, roots, re, im, n, precision, max_iterations, out_root,
+      out_depth);
+}
+
+} // namespace
@@ -1,61 +1,849 @@
 #include "JuliaSet.hh"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <algorithm>
-#include <phosg/Image.hh>
+#include <exception>
+#include <numeric>
 #include <stdexcept>
+#include <thread>
 
 #include "Complex.hh"
 #include "Iterate.hh"
+#include "Pipeline.hh"
+#include "Polynomial.hh"
 
 using namespace std;
 
 
-FractalResult julia_fractal(const vector<complex>& coeffs, size_t w, size_t h,
-    double xmin, double xmax, double ymin, double ymax, double precision,
-    double detect_precision, size_t max_depth, size_t result_bit_width,
-    ssize_t* progress) {
+bool window_needs_double_double(const FractalParameters& params) {
+  // doubles have 53 bits of mantissa; leave at least 10 of them for the
+  // differences between neighboring pixels
+  static constexpr double min_relative_spacing = 1.0 / (1LL << 42);
+  double scale = max({fabs(params.xmin), fabs(params.xmax), fabs(params.ymin),
+      fabs(params.ymax), 1.0});
+  return (fabs(params.xmax - params.xmin) / params.w < scale * min_relative_spacing) ||
+      (fabs(params.ymax - params.ymin) / params.h < scale * min_relative_spacing);
+}
 
-  size_t degree = coeffs.size() - 1;
-  double xs = (xmax - xmin) / w, ys = (ymax - ymin) / h, xp, yp = ymin;
-  FractalResult result = {vector<complex>(), Image(w, h, false, result_bit_width)};
+FractalFrame::FractalFrame(const FractalParameters& params,
+    ResultBuffer&& data) :
+    params(params), poly(params.coeffs),
+    roots(params.roots.empty()
+        ? RootSet(this->poly, params.detect_precision)
+        : RootSet(this->poly, params.roots, params.detect_precision)),
+    xs((params.xmax - params.xmin) / params.w),
+    ys((params.ymax - params.ymin) / params.h),
+    mixed_precision(false),
+    double_double(window_needs_double_double(params)),
+    xmin_dd({params.xmin, params.xmin_low}),
+    ymin_dd({params.ymin, params.ymin_low}),
+    xs_dd((DoubleDouble{params.xmax, params.xmax_low} - this->xmin_dd) /
+        DoubleDouble::from_double(params.w)),
+    ys_dd((DoubleDouble{params.ymax, params.ymax_low} - this->ymin_dd) /
+        DoubleDouble::from_double(params.h)),
+    result({this->roots.get_roots(), move(data), {}, {}}),
+    root_first_pixel(this->roots.size(), SIZE_MAX) {
+  if (this->roots.size() > ResultBuffer::MAX_ROOTS) {
+    throw invalid_argument("polynomial has too many roots");
+  }
+  if ((this->result.data.get_width() != params.w) ||
+      (this->result.data.get_height() != params.h) ||
+      (this->result.data.get_bit_width() != params.result_bit_width)) {
+    this->result.data = ResultBuffer(params.w, params.h, params.result_bit_width);
+  }
 
-  for (size_t y = 0; y < h; y++) {
-    xp = xmin;
+  // repeated roots are merged in the RootSet; each one gets the color of the
+  // first copy
+  if (!params.roots.empty()) {
+    if (params.root_colors.size() != params.roots.size()) {
+      throw invalid_argument("each root must have a color");
+    }
+    this->result.root_colors.resize(this->roots.size(), -1);
+    for (size_t x = 0; x < params.roots.size(); x++) {
+      ssize_t index = this->roots.find(params.roots[x]);
+      if ((index >= 0) && (this->result.root_colors[index] < 0)) {
+        this->result.root_colors[index] = params.root_colors[x];
+      }
+    }
+  }
 
-    for (size_t x = 0; x < w; x++) {
-      complex this_root(xp, yp);
-      size_t this_depth = max_depth;
-      this_root = root(coeffs, this_root, precision, &this_depth);
-      this_depth = max_depth - this_depth;
+  // single precision has 24 bits of mantissa. for its results to be
+  // trustworthy, neighboring pixels' coordinates must be far enough apart to
+  // be distinct, and every root needs a convergence disk (so no repeated
+  // roots) that's large compared to the rounding error near it. the iteration
+  // counter is also a float, so it must be exact up to max_iterations. single
+  // precision is only faster with the vector kernels, which do twice as many
+  // points at once
+  IterationKernel kernel = get_iteration_kernel();
+  if (params.mixed_precision && !this->double_double &&
+      (params.subdivide_tolerance < 0) &&
+      !params.progressive_step && (params.max_iterations < (1 << 24)) &&
+      ((kernel == IterationKernel::AVX2) || (kernel == IterationKernel::AVX512))) {
+    static constexpr double max_relative_error = 1.0 / (1 << 16);
+    double scale = max({fabs(params.xmin), fabs(params.xmax),
+        fabs(params.ymin), fabs(params.ymax), 1.0});
+    this->mixed_precision = (fabs(this->xs) > scale * max_relative_error) &&
+        (fabs(this->ys) > scale * max_relative_error);
+    SplitRoots split_roots = this->roots.split();
+    for (size_t x = 0; this->mixed_precision && (x < split_roots.count); x++) {
+      double root_scale = max({fabs(split_roots.real[x]),
+          fabs(split_roots.imag[x]), 1.0});
+      this->mixed_precision = (sqrt(split_roots.radius2[x]) / 2 >
+          root_scale * max_relative_error);
+    }
+  }
+
+  this->find_symmetries();
+}
+
+void FractalFrame::find_symmetries() {
+  this->mirror_x = false;
+  this->mirror_y = false;
+  this->mirror_y_rotates = false;
+  this->render_w = this->params.w;
+  if (this->double_double || !this->params.w || !this->params.h) {
+    return;
+  }
+
+  // the window's center must be on the axis (to within a tiny fraction of a
+  // pixel) for the pixel grid to be symmetric across it
+  static constexpr double max_center_offset = 1.0 / (1 << 20);
+  bool x_centered = fabs(this->params.xmin + this->params.xmax) <=
+      max_center_offset * fabs(this->xs);
+  bool y_centered = fabs(this->params.ymin + this->params.ymax) <=
+      max_center_offset * fabs(this->ys);
+
+  // p(-z) = +/-p(z) if the differences between the nonzero terms' degrees
+  // are all even, and then Newton's method commutes with negating z
+  const auto& coeffs = this->poly.get_coeffs();
+  bool is_real = true;
+  size_t degree_gcd = 0;
+  ssize_t last_degree = -1;
+  for (size_t x = 0; x < coeffs.size(); x++) {
+    if (coeffs[x].imag != 0.0) {
+      is_real = false;
+    }
+    if ((coeffs[x].real != 0.0) || (coeffs[x].imag != 0.0)) {
+      ssize_t degree = coeffs.size() - 1 - x;
+      if (last_degree >= 0) {
+        degree_gcd = gcd(degree_gcd, static_cast<size_t>(last_degree - degree));
+      }
+      last_degree = degree;
+    }
+  }
+  bool half_turn = !(degree_gcd & 1);
+
+  // the symmetries can't be used if the roots don't map onto each other
+  // (which could only happen because of rounding errors)
+  const auto& roots = this->roots.get_roots();
+  auto make_root_map = [&](vector<uint8_t>& root_map, bool negate_real,
+      bool negate_imag) -> bool {
+    root_map.resize(roots.size());
+    for (size_t x = 0; x < roots.size(); x++) {
+      ssize_t index = this->roots.find(complex(
+          negate_real ? -roots[x].real : roots[x].real,
+          negate_imag ? -roots[x].imag : roots[x].imag));
+      if (index < 0) {
+        return false;
+      }
+      root_map[x] = index;
+    }
+    return true;
+  };
+  this->mirror_x = is_real && half_turn && x_centered &&
+      make_root_map(this->mirror_x_roots, true, false);
+  if (y_centered && is_real) {
+    this->mirror_y = make_root_map(this->mirror_y_roots, false, true);
+  } else if (y_centered && x_centered && half_turn) {
+    this->mirror_y = make_root_map(this->mirror_y_roots, true, true);
+    this->mirror_y_rotates = true;
+  }
+
+  // mixed precision compares each pixel with its neighbors, so it also
+  // renders the column just past the axis
+  if (this->mirror_x) {
+    this->render_w = min<size_t>(this->params.w,
+        this->params.w / 2 + (this->mixed_precision ? 2 : 1));
+  }
+}
 
-      if ((this_root.real == 0) && (this_root.imag == 0)) {
-        result.data.write_pixel(x, y, 0, 0, 1);
+size_t FractalFrame::rendered_height() const {
+  return this->mirror_y ? min<size_t>(this->params.h, this->params.h / 2 + 1)
+                        : this->params.h;
+}
 
+void FractalFrame::fill_symmetric() {
+  size_t w = this->params.w, h = this->params.h;
+  ResultBuffer& data = this->result.data;
+  ThreadState ts;
+  ts.root_first_pixel.resize(this->roots.size(), SIZE_MAX);
+  auto copy_pixel = [&](size_t x, size_t y, size_t src_x, size_t src_y,
+      const vector<uint8_t>& root_map) {
+    uint8_t root_index = data.get_root(src_x, src_y);
+    if (ResultBuffer::is_root_index(root_index)) {
+      root_index = root_map[root_index];
+      ts.root_first_pixel[root_index] = min(ts.root_first_pixel[root_index],
+          y * w + x);
+    }
+    data.set(x, y, data.get_depth(src_x, src_y), root_index);
+  };
+
+  // reflect the left half of the rendered rows, then reflect or rotate all
+  // the rendered rows. after a half turn, the pixels in the first column come
+  // from past the right edge of the frame, so they're computed instead
+  size_t y_end = this->rendered_height();
+  if (this->mirror_x) {
+    for (size_t y = 0; y < y_end; y++) {
+      for (size_t x = w / 2 + 1; x < w; x++) {
+        copy_pixel(x, y, w - x, y, this->mirror_x_roots);
+      }
+    }
+  }
+  if (this->mirror_y) {
+    for (size_t y = y_end; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        if (!this->mirror_y_rotates) {
+          copy_pixel(x, y, x, h - y, this->mirror_y_roots);
+        } else if (x) {
+          copy_pixel(x, y, w - x, h - y, this->mirror_y_roots);
+        } else {
+          ts.pixel_x.emplace_back(x);
+          ts.pixel_y.emplace_back(y);
+        }
+      }
+    }
+    this->compute_pixels(ts);
+  }
+  this->merge_thread_state(ts);
+}
+
+size_t FractalFrame::band_height() const {
+  // progressive bands must line up with the first pass' blocks, and
+  // subdivision needs large areas to be effective
+  if (this->params.progressive_step) {
+    return max<size_t>(this->params.progressive_step, 8);
+  }
+  // mixed precision also computes one row above and below each band
+  if (this->mixed_precision) {
+    return 32;
+  }
+  return (this->params.subdivide_tolerance < 0) ? 8 : 64;
+}
+
+void FractalFrame::merge_thread_state(const ThreadState& ts) {
+  lock_guard<mutex> g(this->lock);
+  for (size_t x = 0; x < ts.root_first_pixel.size(); x++) {
+    this->root_first_pixel[x] = min(this->root_first_pixel[x], ts.root_first_pixel[x]);
+  }
+}
+
+void FractalFrame::begin_points(ThreadState& ts, size_t count) const {
+  if (this->double_double) {
+    ts.re_dd.resize(count);
+    ts.im_dd.resize(count);
+  } else {
+    ts.re.resize(count);
+    ts.im.resize(count);
+  }
+  ts.root_indexes.resize(count);
+  ts.depths.resize(count);
+}
+
+void FractalFrame::set_point(ThreadState& ts, size_t z, double x,
+    double y) const {
+  if (this->double_double) {
+    ts.re_dd[z] = this->xmin_dd + DoubleDouble::from_double(x) * this->xs_dd;
+    ts.im_dd[z] = this->ymin_dd + DoubleDouble::from_double(y) * this->ys_dd;
+  } else {
+    ts.re[z] = this->params.xmin + x * this->xs;
+    ts.im[z] = this->params.ymin + y * this->ys;
+  }
+}
+
+void FractalFrame::iterate_points(ThreadState& ts, size_t count) const {
+  if (this->double_double) {
+    root_batch_dd(this->poly, this->roots, ts.re_dd.data(), ts.im_dd.data(),
+        count, this->params.precision, this->params.max_iterations,
+        ts.root_indexes.data(), ts.depths.data());
+  } else {
+    root_batch(this->poly, this->roots, ts.re.data(), ts.im.data(), count,
+        this->params.precision, this->params.max_iterations,
+        ts.root_indexes.data(), ts.depths.data());
+  }
+}
+
+// stores a result from root_batch (or root_batch_dd) in buf
+static void set_result(ResultBuffer& buf, size_t x, size_t y,
+    ssize_t root_index, size_t depth) {
+  if (root_index == -3) {
+    buf.set(x, y, 0, ResultBuffer::CYCLE_ROOT);
+  } else if (root_index < 0) {
+    buf.set(x, y, 0, ResultBuffer::ERROR_ROOT);
+  } else {
+    buf.set(x, y, depth, root_index);
+  }
+}
+
+void FractalFrame::compute_pixels(ThreadState& ts) {
+  size_t count = ts.pixel_x.size();
+  this->begin_points(ts, count);
+  for (size_t z = 0; z < count; z++) {
+    this->set_point(ts, z, ts.pixel_x[z], ts.pixel_y[z]);
+  }
+  this->iterate_points(ts, count);
+
+  ts.root_first_pixel.resize(this->roots.size(), SIZE_MAX);
+  for (size_t z = 0; z < count; z++) {
+    size_t x = ts.pixel_x[z], y = ts.pixel_y[z];
+    ssize_t root_index = ts.root_indexes[z];
+    if (root_index >= 0) {
+      ts.root_first_pixel[root_index] = min(ts.root_first_pixel[root_index],
+          y * this->params.w + x);
+    }
+    set_result(this->result.data, x, y, root_index, ts.depths[z]);
+  }
+
+  ts.pixel_x.clear();
+  ts.pixel_y.clear();
+}
+
+void FractalFrame::render_rows(size_t y_start, size_t y_end) {
+  ThreadState ts;
+
+  if (this->mixed_precision) {
+    this->render_rows_mixed(ts, y_start, y_end);
+
+  } else if (this->params.subdivide_tolerance < 0) {
+    // each row is iterated as one batch
+    for (size_t y = y_start; y < y_end; y++) {
+      for (size_t x = 0; x < this->render_w; x++) {
+        ts.pixel_x.emplace_back(x);
+        ts.pixel_y.emplace_back(y);
+      }
+      this->compute_pixels(ts);
+    }
+
+  } else if (y_end > y_start) {
+    vector<uint8_t> computed(this->params.w * (y_end - y_start), 0);
+    this->render_subdivided(ts, computed, y_start, 0, y_start,
+        this->render_w - 1, y_end - 1);
+  }
+
+  this->merge_thread_state(ts);
+}
+
+// Mixed-precision rendering: iterate all the rows in single precision first,
+// then compute again in double precision each pixel that didn't reach a root
+// in single precision (including those that single precision couldn't
+// classify; see root_batch_float), and each pixel that may be near a basin
+// boundary because one of its neighbors got a different result. Pixels far
+// from the boundaries end up in the same place in both precisions, so this
+// gives the same roots as double precision alone (and depths within one
+// iteration), but faster when most of the image is inside large basins. Pixels
+// that don't reach a root in single precision are always recomputed. To check
+// the pixels at the top and bottom of the band, the rows just outside it are
+// also computed.
+void FractalFrame::render_rows_mixed(ThreadState& ts, size_t y_start,
+    size_t y_end) {
+  size_t w = this->render_w;
+  size_t y0 = (y_start > 0) ? (y_start - 1) : 0;
+  size_t y1 = min(y_end + 1, this->params.h);
+  vector<ssize_t> float_roots(w * (y1 - y0));
+  vector<size_t> float_depths(w * (y1 - y0));
+  vector<double> re(w), im(w);
+  for (size_t x = 0; x < w; x++) {
+    re[x] = this->params.xmin + x * this->xs;
+  }
+  for (size_t y = y0; y < y1; y++) {
+    fill(im.begin(), im.end(), this->params.ymin + y * this->ys);
+    root_batch_float(this->poly, this->roots, re.data(), im.data(), w,
+        this->params.precision, this->params.max_iterations,
+        float_roots.data() + (y - y0) * w, float_depths.data() + (y - y0) * w);
+  }
+
+  // a pixel is ambiguous if single precision didn't reach a root (rounding
+  // can keep a point from converging, or trap it in a cycle, when double
+  // precision would have gotten out), or if any of its eight neighbors reached
+  // a different root or has a depth that differs by more than 2 (basins are
+  // smooth away from their boundaries, so a steep change means a boundary is
+  // nearby). this compares each pair of neighbors once, and marks both if they
+  // differ
+  size_t rows = y1 - y0;
+  vector<uint8_t> ambiguous(w * rows, 0);
+  for (size_t z = 0; z < ambiguous.size(); z++) {
+    ambiguous[z] = (float_roots[z] < 0);
+  }
+  auto compare = [&](size_t z1, size_t z2) {
+    if ((float_roots[z1] != float_roots[z2]) || ((float_roots[z1] >= 0) &&
+        ((float_depths[z1] > float_depths[z2] + 2) ||
+         (float_depths[z2] > float_depths[z1] + 2)))) {
+      ambiguous[z1] = ambiguous[z2] = 1;
+    }
+  };
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t z = r * w + x;
+      if (x + 1 < w) {
+        compare(z, z + 1);
+      }
+      if (r + 1 < rows) {
+        compare(z, z + w);
+        if (x + 1 < w) {
+          compare(z, z + w + 1);
+        }
+        if (x > 0) {
+          compare(z, z + w - 1);
+        }
+      }
+    }
+  }
+
+  ts.root_first_pixel.resize(this->roots.size(), SIZE_MAX);
+  for (size_t y = y_start; y < y_end; y++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t z = (y - y0) * w + x;
+      ssize_t root_index = float_roots[z];
+      if (ambiguous[z]) {
+        ts.pixel_x.emplace_back(x);
+        ts.pixel_y.emplace_back(y);
       } else {
-        size_t root_index;
-        for (root_index = 0; root_index < result.roots.size(); root_index++) {
-          if (result.roots[root_index].equal(this_root, detect_precision)) {
-            break;
+        ts.root_first_pixel[root_index] = min(ts.root_first_pixel[root_index],
+            y * this->params.w + x);
+        this->result.data.set(x, y, float_depths[z], root_index);
+      }
+    }
+  }
+  this->compute_pixels(ts);
+}
+
+void FractalFrame::render_pass_rows(size_t step, size_t y_start, size_t y_end) {
+  ThreadState ts;
+
+  size_t first_step = this->params.progressive_step;
+  size_t w = this->render_w;
+  for (size_t y = y_start; y < y_end; y += step) {
+    // the previous pass did every other pixel in every other row
+    bool skip_even = (step < first_step) && ((y & (2 * step - 1)) == 0);
+    for (size_t x = 0; x < w; x += (skip_even ? 2 * step : step)) {
+      ts.pixel_x.emplace_back(skip_even ? (x + step) : x);
+      ts.pixel_y.emplace_back(y);
+    }
+    if (!ts.pixel_x.empty() && (ts.pixel_x.back() >= w)) {
+      ts.pixel_x.pop_back();
+      ts.pixel_y.pop_back();
+    }
+    vector<size_t> row_xs = ts.pixel_x;
+    this->compute_pixels(ts);
+
+    if (step > 1) {
+      size_t block_y_end = min(y + step, y_end);
+      for (size_t x : row_xs) {
+        uint64_t depth = this->result.data.get_depth(x, y);
+        uint8_t root_index = this->result.data.get_root(x, y);
+        size_t block_x_end = min(x + step, w);
+        for (size_t by = y; by < block_y_end; by++) {
+          for (size_t bx = (by == y) ? (x + 1) : x; bx < block_x_end; bx++) {
+            this->result.data.set(bx, by, depth, root_index);
           }
         }
+      }
+    }
+  }
 
-        if (root_index == result.roots.size()) {
-          if (result.roots.size() > degree) {
-            throw runtime_error("too many roots");
-          }
-          result.roots.push_back(this_root);
+  this->merge_thread_state(ts);
+}
+
+// Mariani-Silver subdivision: compute the pixels on the border of a rectangle
+// (x0, y0)-(x1, y1) (inclusive). If they all reached the same root and their
+// depths are within subdivide_tolerance of each other, fill the inside of the
+// rectangle without computing it; otherwise, split it in half and repeat.
+// Borders that are all caught in cycles are filled in too, but borders with
+// pixels that just didn't converge never are.
+// With a tolerance of zero, the filled depths are those of the border;
+// otherwise they're interpolated between the border pixels. A uniform border
+// doesn't guarantee a uniform inside (a small island of another basin may be
+// entirely inside the rectangle), so the result can differ from computing
+// every pixel, even with a tolerance of zero. computed tracks
+// which pixels in the band (starting at row y_base) have been done already.
+void FractalFrame::render_subdivided(ThreadState& ts, vector<uint8_t>& computed,
+    size_t y_base, size_t x0, size_t y0, size_t x1, size_t y1) {
+  // rectangles this small are just computed directly
+  static constexpr size_t min_subdivide_area = 64;
+
+  auto add_pixel = [&](size_t x, size_t y) {
+    uint8_t& c = computed[(y - y_base) * this->params.w + x];
+    if (!c) {
+      c = 1;
+      ts.pixel_x.emplace_back(x);
+      ts.pixel_y.emplace_back(y);
+    }
+  };
+
+  if ((x1 - x0 + 1) * (y1 - y0 + 1) <= min_subdivide_area) {
+    for (size_t y = y0; y <= y1; y++) {
+      for (size_t x = x0; x <= x1; x++) {
+        add_pixel(x, y);
+      }
+    }
+    this->compute_pixels(ts);
+    return;
+  }
+
+  for (size_t x = x0; x <= x1; x++) {
+    add_pixel(x, y0);
+    add_pixel(x, y1);
+  }
+  for (size_t y = y0 + 1; y < y1; y++) {
+    add_pixel(x0, y);
+    add_pixel(x1, y);
+  }
+  this->compute_pixels(ts);
+
+  // check if the border is all the same root, and get its depth range
+  bool uniform = true;
+  uint8_t border_root = 0;
+  uint64_t min_depth = UINT64_MAX, max_depth = 0;
+  auto check_pixel = [&](size_t x, size_t y) {
+    uint64_t depth = this->result.data.get_depth(x, y);
+    uint8_t root_index = this->result.data.get_root(x, y);
+    if ((root_index == ResultBuffer::ERROR_ROOT) ||
+        ((min_depth != UINT64_MAX) && (root_index != border_root))) {
+      uniform = false;
+    }
+    border_root = root_index;
+    min_depth = min(min_depth, depth);
+    max_depth = max(max_depth, depth);
+  };
+  for (size_t x = x0; uniform && (x <= x1); x++) {
+    check_pixel(x, y0);
+    check_pixel(x, y1);
+  }
+  for (size_t y = y0 + 1; uniform && (y < y1); y++) {
+    check_pixel(x0, y);
+    check_pixel(x1, y);
+  }
+  uniform &= (max_depth - min_depth <= static_cast<uint64_t>(this->params.subdivide_tolerance));
+
+  if (!uniform) {
+    if (x1 - x0 >= y1 - y0) {
+      size_t xm = (x0 + x1) / 2;
+      this->render_subdivided(ts, computed, y_base, x0, y0, xm, y1);
+      this->render_subdivided(ts, computed, y_base, xm, y0, x1, y1);
+    } else {
+      size_t ym = (y0 + y1) / 2;
+      this->render_subdivided(ts, computed, y_base, x0, y0, x1, ym);
+      this->render_subdivided(ts, computed, y_base, x0, ym, x1, y1);
+    }
+    return;
+  }
+
+  // fill the inside. each pixel gets the average of the depths interpolated
+  // horizontally and vertically between the border pixels, so it's always
+  // within the border's depth range
+  vector<uint64_t> top_depths, bottom_depths;
+  if (max_depth != min_depth) {
+    for (size_t x = x0; x <= x1; x++) {
+      top_depths.emplace_back(this->result.data.get_depth(x, y0));
+      bottom_depths.emplace_back(this->result.data.get_depth(x, y1));
+    }
+  }
+  for (size_t y = y0 + 1; y < y1; y++) {
+    uint64_t left_depth = min_depth, right_depth = min_depth;
+    if (max_depth != min_depth) {
+      left_depth = this->result.data.get_depth(x0, y);
+      right_depth = this->result.data.get_depth(x1, y);
+    }
+    double v = static_cast<double>(y - y0) / (y1 - y0);
+
+    for (size_t x = x0 + 1; x < x1; x++) {
+      uint8_t& c = computed[(y - y_base) * this->params.w + x];
+      if (c) {
+        continue;
+      }
+      c = 1;
+
+      uint64_t depth = min_depth;
+      if (max_depth != min_depth) {
+        double u = static_cast<double>(x - x0) / (x1 - x0);
+        double top = top_depths[x - x0], bottom = bottom_depths[x - x0];
+        double horizontal = left_depth + u * (static_cast<double>(right_depth) - left_depth);
+        double vertical = top + v * (bottom - top);
+        depth = static_cast<uint64_t>((horizontal + vertical) / 2 + 0.5);
+      }
+      this->result.data.set(x, y, depth, border_root);
+    }
+  }
+}
+
+bool FractalFrame::needs_supersampling() const {
+  return this->params.supersample > 1;
+}
+
+bool FractalFrame::is_boundary_pixel(size_t x, size_t y) const {
+  const ResultBuffer& data = this->result.data;
+  uint8_t root = data.get_root(x, y);
+  uint64_t depth = data.get_depth(x, y);
+  size_t x_end = min(x + 2, this->params.w), y_end = min(y + 2, this->params.h);
+  for (size_t ny = y ? (y - 1) : 0; ny < y_end; ny++) {
+    for (size_t nx = x ? (x - 1) : 0; nx < x_end; nx++) {
+      uint64_t neighbor_depth = data.get_depth(nx, ny);
+      if ((data.get_root(nx, ny) != root) || (neighbor_depth > depth + 1) ||
+          (depth > neighbor_depth + 1)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Supersampling: each boundary pixel gets samples at n x n evenly spaced
+// points within it (including the one it was rendered at, which isn't
+// computed again). The samples of a band's pixels are iterated in batches of
+// about a row's worth of points.
+void FractalFrame::supersample_rows(size_t y_start, size_t y_end) {
+  size_t w = this->params.w;
+  size_t n = this->params.supersample;
+  size_t samples_per_pixel = n * n;
+
+  Supersamples band;
+  for (size_t y = y_start; y < y_end; y++) {
+    for (size_t x = 0; x < w; x++) {
+      if (this->is_boundary_pixel(x, y)) {
+        band.pixels.emplace_back(y * w + x);
+      }
+    }
+  }
+  band.samples = ResultBuffer(samples_per_pixel, band.pixels.size(),
+      this->params.result_bit_width);
+
+  ThreadState ts;
+  size_t batch_pixels = max<size_t>(w / (samples_per_pixel - 1), 1);
+  for (size_t start = 0; start < band.pixels.size(); start += batch_pixels) {
+    size_t end = min(start + batch_pixels, band.pixels.size());
+    size_t count = (end - start) * (samples_per_pixel - 1);
+    this->begin_points(ts, count);
+    for (size_t p = start, z = 0; p < end; p++) {
+      size_t x = band.pixels[p] % w, y = band.pixels[p] / w;
+      for (size_t s = 1; s < samples_per_pixel; s++, z++) {
+        this->set_point(ts, z, x + static_cast<double>(s % n) / n,
+            y + static_cast<double>(s / n) / n);
+      }
+    }
+    this->iterate_points(ts, count);
+
+    for (size_t p = start, z = 0; p < end; p++) {
+      size_t x = band.pixels[p] % w, y = band.pixels[p] / w;
+      band.samples.set(0, p, this->result.data.get_depth(x, y),
+          this->result.data.get_root(x, y));
+      for (size_t s = 1; s < samples_per_pixel; s++, z++) {
+        set_result(band.samples, s, p, ts.root_indexes[z], ts.depths[z]);
+      }
+    }
+  }
+
+  lock_guard<mutex> g(this->lock);
+  this->supersample_bands.emplace(y_start, move(band));
+}
+
+void FractalFrame::renumber_roots(FractalResult& res,
+    const vector<size_t>& first_pixel) const {
+  // renumber the roots in order of first appearance
+  vector<size_t> order(res.roots.size());
+  for (size_t x = 0; x < order.size(); x++) {
+    order[x] = x;
+  }
+  stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return first_pixel[a] < first_pixel[b];
+  });
+
+  bool renumber = false;
+  uint8_t new_index[0x100];
+  memset(new_index, ResultBuffer::ERROR_ROOT, sizeof(new_index));
+  new_index[ResultBuffer::CYCLE_ROOT] = ResultBuffer::CYCLE_ROOT;
+  vector<complex> new_roots(order.size());
+  for (size_t x = 0; x < order.size(); x++) {
+    new_index[order[x]] = x;
+    new_roots[x] = res.roots[order[x]];
+    renumber |= (order[x] != x);
+  }
+
+  if (renumber) {
+    // new_index maps ERROR_ROOT and CYCLE_ROOT to themselves
+    uint8_t* roots = res.data.get_roots();
+    size_t count = this->params.w * this->params.h;
+    for (size_t z = 0; z < count; z++) {
+      roots[z] = new_index[roots[z]];
+    }
+    uint8_t* sample_roots = res.supersamples.samples.get_roots();
+    count = res.supersamples.samples.get_width() * res.supersamples.samples.get_height();
+    for (size_t z = 0; z < count; z++) {
+      sample_roots[z] = new_index[sample_roots[z]];
+    }
+    res.roots = move(new_roots);
+  }
+}
+
+FractalResult FractalFrame::snapshot() const {
+  FractalResult ret = this->result;
+  if (!this->params.roots.empty()) {
+    return ret;
+  }
+
+  // pixels that haven't been computed yet have been filled in with the values
+  // of nearby pixels that have, so this is the same as finish() once all the
+  // pixels are done
+  vector<size_t> first_pixel(ret.roots.size(), SIZE_MAX);
+  const uint8_t* roots = ret.data.get_roots();
+  size_t count = this->params.w * this->params.h;
+  for (size_t z = 0; z < count; z++) {
+    if (ResultBuffer::is_root_index(roots[z]) && (first_pixel[roots[z]] == SIZE_MAX)) {
+      first_pixel[roots[z]] = z;
+    }
+  }
+
+  this->renumber_roots(ret, first_pixel);
+  return ret;
+}
+
+FractalResult FractalFrame::finish() {
+  // put the supersampling bands together in order
+  if (!this->supersample_bands.empty()) {
+    size_t count = 0;
+    for (const auto& it : this->supersample_bands) {
+      count += it.second.pixels.size();
+    }
+    size_t samples_per_pixel = this->params.supersample * this->params.supersample;
+    Supersamples& ss = this->result.supersamples;
+    ss.pixels.clear();
+    ss.pixels.reserve(count);
+    ss.samples = ResultBuffer(samples_per_pixel, count,
+        this->params.result_bit_width);
+    for (const auto& it : this->supersample_bands) {
+      const Supersamples& band = it.second;
+      for (size_t p = 0; p < band.pixels.size(); p++) {
+        size_t row = ss.pixels.size();
+        ss.pixels.emplace_back(band.pixels[p]);
+        for (size_t s = 0; s < samples_per_pixel; s++) {
+          ss.samples.set(s, row, band.samples.get_depth(s, p),
+              band.samples.get_root(s, p));
         }
-        result.data.write_pixel(x, y, this_depth, root_index, 0);
       }
+    }
+    this->supersample_bands.clear();
+  }
 
-      xp += xs;
+  if (this->params.roots.empty()) {
+    this->renumber_roots(this->result, this->root_first_pixel);
+  }
+  return move(this->result);
+}
+
+
+
+FractalResult julia_fractal(const FractalParameters& params,
+    const RenderOptions& options) {
+
+  FractalFrame frame(params);
+
+  // threads take small bands of rows from the top of the image until there
+  // are none left, so they all finish at about the same time. in progressive
+  // mode, this is done once per pass (and progress counts the rows done in the
+  // current pass), and the same goes for the supersampling pass. if the frame
+  // is symmetric, the rendering passes only cover part of it, and the rest is
+  // filled in after each one
+  size_t band_height = frame.band_height();
+  size_t h = 0;
+  size_t pass_step = 0;
+  bool supersampling = false;
+  atomic<size_t> next_row(0);
+  atomic<size_t> rows_done(0);
+  mutex progress_lock;
+  auto render_bands = [&]() {
+    for (;;) {
+      if (options.cancel && options.cancel->is_cancelled()) {
+        throw RenderCancelled();
+      }
+      size_t y_start = next_row.fetch_add(band_height);
+      if (y_start >= h) {
+        break;
+      }
+      size_t y_end = min(y_start + band_height, h);
+      if (supersampling) {
+        frame.supersample_rows(y_start, y_end);
+      } else if (pass_step) {
+        frame.render_pass_rows(pass_step, y_start, y_end);
+      } else {
+        frame.render_rows(y_start, y_end);
+      }
+      rows_done += (y_end - y_start);
+      if (options.on_progress) {
+        // rows_done is read while holding the lock, so the counts passed to
+        // on_progress never go backward
+        lock_guard<mutex> g(progress_lock);
+        options.on_progress(rows_done.load(), h);
+      }
+    }
+  };
+
+  // if any thread fails (or the render is cancelled), the error is rethrown
+  // here after all the threads have stopped
+  exception_ptr exc;
+  mutex exc_lock;
+  auto render_bands_noexcept = [&]() {
+    try {
+      render_bands();
+    } catch (...) {
+      lock_guard<mutex> g(exc_lock);
+      if (!exc) {
+        exc = current_exception();
+      }
+      next_row = h;
+    }
+  };
+
+  auto render_pass = [&]() {
+    h = supersampling ? params.h : frame.rendered_height();
+    next_row = 0;
+    rows_done = 0;
+    if (options.pool) {
+      vector<function<void()>> fns(options.pool->size() + 1,
+          render_bands_noexcept);
+      options.pool->run_all(fns);
+    } else {
+      vector<thread> threads;
+      for (size_t x = 1; x < options.thread_count; x++) {
+        threads.emplace_back(render_bands_noexcept);
+      }
+      render_bands_noexcept();
+      for (auto& t : threads) {
+        t.join();
+      }
     }
-    yp += ys;
-    *progress = y;
+    if (exc) {
+      rethrow_exception(exc);
+    }
+    if (!supersampling) {
+      frame.fill_symmetric();
+    }
+  };
+
+  if (params.progressive_step) {
+    for (pass_step = params.progressive_step; pass_step > 1; pass_step /= 2) {
+      render_pass();
+      if (options.on_pass) {
+        options.on_pass(frame.snapshot());
+      }
+    }
+  }
+  render_pass();
+  if (frame.needs_supersampling()) {
+    supersampling = true;
+    render_pass();
   }
 
-  return result;
+  return frame.finish();
 }
@@ -1,18 +1,244 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include <atomic>
-#include <phosg/Image.hh>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 
 #include "Complex.hh"
+#include "DoubleDouble.hh"
+#include "Polynomial.hh"
+#include "ResultBuffer.hh"
+#include "Roots.hh"
+
+
+struct FractalParameters {
+  std::vector<complex> coeffs;
+  size_t w, h;
+  double xmin, xmax, ymin, ymax;
+  // the low-order parts of the window's bounds, for windows too small to be
+  // described with doubles (see window_needs_double_double). usually zero
+  double xmin_low, xmax_low, ymin_low, ymax_low;
+  double precision, detect_precision;
+  size_t max_iterations;
+  size_t result_bit_width;
+  // if nonnegative, use subdivision (see FractalFrame::render_subdivided) and
+  // allow border depths to differ by this much in filled rectangles. this is a
+  // heuristic: even with 0, small features inside a rectangle that don't reach
+  // its border are filled over, so some pixels may get the wrong root or depth
+  ssize_t subdivide_tolerance;
+  // if nonzero, render progressively (see julia_fractal), starting with every
+  // Nth pixel; must be a power of 2
+  size_t progressive_step;
+  // if true, iterate in single precision first, and only use double precision
+  // for the pixels that it can't classify reliably: those that don't reach a
+  // root in single precision, and those near a basin boundary (see
+  // FractalFrame::render_rows_mixed). this only saves time when most pixels
+  // are far inside basins and take many iterations; pixels that don't reach a
+  // root are iterated twice. this is ignored with subdivision or
+  // progressive rendering, without a vector kernel, or if the frame can't be
+  // done accurately this way
+  bool mixed_precision;
+  // if greater than 1, take supersample x supersample samples for each pixel
+  // on a basin boundary (one whose root differs from any of its neighbors', or
+  // whose depth differs from theirs by more than 1), to be blended together
+  // when coloring the image
+  size_t supersample;
+  // if not empty, the roots of the polynomial (from find_roots or a
+  // RootTracker) and the color index to use for each of them. otherwise, the
+  // roots are found when rendering starts and numbered by where they first
+  // appear in the image
+  std::vector<complex> roots;
+  std::vector<size_t> root_colors;
+};
 
+// returns true if the window is so small that neighboring pixels' coordinates
+// can't be represented accurately as doubles. such frames are rendered with
+// double-double arithmetic (see root_batch_dd), which is much slower
+bool window_needs_double_double(const FractalParameters& params);
 
 struct FractalResult {
   std::vector<complex> roots;
-  Image data;
+  ResultBuffer data;
+  // the color index for each root, if the roots were given in the parameters
+  std::vector<ssize_t> root_colors;
+  // the extra samples for the boundary pixels, if supersampling
+  Supersamples supersamples;
+};
+
+// A single frame being rendered. The polynomial's roots are all found before
+// rendering starts, and each pixel is classified by which root it reaches.
+// Rows may be rendered by multiple threads at once. Roots are numbered in the
+// order they first appear in the image (in row order), so the numbering
+// doesn't depend on how the rows were split up; roots that don't appear come
+// last. If the roots are given in the parameters, their order doesn't change,
+// and each one gets the given color instead.
+//
+// Some frames are symmetric, and only part of them is rendered; the rest is
+// reflected or rotated from it by fill_symmetric, with the roots swapped to
+// match. If the coefficients are all real, the image is symmetric across the
+// real axis; if the polynomial's nonzero terms' degrees are all even or all odd
+// (e.g. z^4 - c), it's symmetric under a half turn around the origin; and if
+// both are true, it's also symmetric across the imaginary axis. These are used
+// when the window is centered on the axes they need. Other rotations (e.g. the
+// 3-fold symmetry of z^3 - c) don't map the pixel grid onto itself, so they
+// aren't used.
+class FractalFrame {
+public:
+  // if data is the right size (e.g. a buffer from a ResultBufferPool), the
+  // results are written there instead of in a new buffer. its contents don't
+  // matter, since every pixel is overwritten
+  explicit FractalFrame(const FractalParameters& params,
+      ResultBuffer&& data = ResultBuffer());
+
+  // the rows that must be rendered are [0, rendered_height()). if this is
+  // less than the frame's height, fill_symmetric must be called after each
+  // pass over them (before snapshot, needs_supersampling or finish)
+  size_t rendered_height() const;
+  void fill_symmetric();
+
+  void render_rows(size_t y_start, size_t y_end);
+
+  // renders one progressive pass over some rows: computes every pixel whose
+  // coordinates are both multiples of step (except those that an earlier pass
+  // already computed) and fills the step x step block below and to the right
+  // of each with its value. y_start must be a multiple of the first pass'
+  // step. the passes must be done in order, from progressive_step down to 1
+  void render_pass_rows(size_t step, size_t y_start, size_t y_end);
+
+  // returns a copy of the frame so far (e.g. between progressive passes). the
+  // roots are numbered by where they first appear in the copy, which is
+  // usually the same as in the finished frame
+  FractalResult snapshot() const;
+
+  // must be called after all rows are rendered
+  FractalResult finish();
+
+  // returns true if the frame needs a supersampling pass, in which
+  // supersample_rows is called for all the rows after they're all rendered
+  // (and before finish)
+  bool needs_supersampling() const;
+  // takes the extra samples for the boundary pixels in these rows
+  void supersample_rows(size_t y_start, size_t y_end);
+
+  // a good number of rows for each call to render_rows or supersample_rows
+  size_t band_height() const;
+
+private:
+  FractalParameters params;
+  Polynomial poly;
+  RootSet roots;
+  double xs, ys;
+  // true if params.mixed_precision is set and usable for this frame
+  bool mixed_precision;
+  // true if the window needs double-double precision, in which case the
+  // pixels' coordinates are xmin_dd + x * xs_dd and ymin_dd + y * ys_dd
+  bool double_double;
+  DoubleDouble xmin_dd, ymin_dd, xs_dd, ys_dd;
+  FractalResult result;
+
+  // if mirror_x is true, pixel (w - x, y) is pixel (x, y) reflected across
+  // the imaginary axis. if mirror_y is true, pixel (x, h - y) is pixel (x, y)
+  // reflected across the real axis, or if mirror_y_rotates is also true,
+  // pixel (w - x, y) rotated by a half turn. the maps give the root that each
+  // root becomes when it's reflected or rotated
+  bool mirror_x, mirror_y, mirror_y_rotates;
+  std::vector<uint8_t> mirror_x_roots, mirror_y_roots;
+  // the columns that are rendered; the rest come from fill_symmetric
+  size_t render_w;
+
+  std::mutex lock;
+  // for each root, the position (y * w + x) of the first pixel that reached it
+  std::vector<size_t> root_first_pixel;
+  // the samples taken by each call to supersample_rows, by y_start. finish()
+  // puts them together in result.supersamples
+  std::map<size_t, Supersamples> supersample_bands;
+
+  // state for one thread rendering part of the frame
+  struct ThreadState {
+    // the first pixel rendered by this thread that reached each root
+    std::vector<size_t> root_first_pixel;
+
+    // pixels waiting for compute_pixels, and temporary space for it
+    std::vector<size_t> pixel_x, pixel_y;
+    std::vector<double> re, im;
+    std::vector<DoubleDouble> re_dd, im_dd;
+    std::vector<ssize_t> root_indexes;
+    std::vector<size_t> depths;
+  };
+
+  // iterating any set of points: begin_points makes room for count of them,
+  // set_point sets the zth one to the point at pixel coordinates (x, y), and
+  // iterate_points puts their results in ts.root_indexes and ts.depths
+  void begin_points(ThreadState& ts, size_t count) const;
+  void set_point(ThreadState& ts, size_t z, double x, double y) const;
+  void iterate_points(ThreadState& ts, size_t count) const;
+
+  void compute_pixels(ThreadState& ts);
+  void render_rows_mixed(ThreadState& ts, size_t y_start, size_t y_end);
+  void merge_thread_state(const ThreadState& ts);
+  void find_symmetries();
+  bool is_boundary_pixel(size_t x, size_t y) const;
+  void renumber_roots(FractalResult& res,
+      const std::vector<size_t>& first_pixel) const;
+
+  void render_subdivided(ThreadState& ts, std::vector<uint8_t>& computed,
+      size_t y_base, size_t x0, size_t y0, size_t x1, size_t y1);
+};
+
+class ThreadPool;
+
+// Lets any thread stop renders that are in progress (see RenderOptions). A
+// token can be shared by any number of renders, and can't be reset.
+class CancellationToken {
+public:
+  CancellationToken() : cancelled(false) { }
+
+  void cancel() {
+    this->cancelled.store(true, std::memory_order_relaxed);
+  }
+  bool is_cancelled() const {
+    return this->cancelled.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<bool> cancelled;
+};
+
+// thrown by julia_fractal if its render is cancelled
+class RenderCancelled : public std::runtime_error {
+public:
+  RenderCancelled() : std::runtime_error("render cancelled") { }
+};
+
+struct RenderOptions {
+  // the rows are split up among the pool's threads and the calling thread if
+  // pool is given, or else among thread_count threads (including the calling
+  // thread) that are started for this render
+  ThreadPool* pool = nullptr;
+  size_t thread_count = 1;
+  // if this is cancelled, the render stops as soon as each thread finishes
+  // the band of rows it's working on, and julia_fractal throws
+  // RenderCancelled
+  const CancellationToken* cancel = nullptr;
+  // called after each band of rows is done, with the number of rows done so
+  // far in the current pass (see below) and the number of rows in the pass
+  // (which is less than the frame's height if the frame is symmetric). it may
+  // be called on any of the rendering threads, but never on two at once
+  std::function<void(size_t rows_done, size_t rows_total)> on_progress;
+  // called with the partial image after each progressive pass except the last
+  std::function<void(const FractalResult&)> on_pass;
 };
 
-FractalResult julia_fractal(const std::vector<complex>& coeffs, size_t w,
-    size_t h, double xmin, double xmax, double ymin, double ymax,
-    double precision, double detect_precision, size_t max_depth,
-    size_t result_bit_width, ssize_t* progress);
+// Renders a frame. This may be called from several threads at once, for
+// different frames. If params.progressive_step is nonzero, the frame is
+// rendered in passes, each at twice the resolution of the previous one. No
+// pixel is computed more than once. Supersampling is done in another pass after
+// all the pixels are rendered, so the partial images don't have it.
+FractalResult julia_fractal(const FractalParameters& params,
+    const RenderOptions& options = RenderOptions());
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,199 +8,170 @@
 
 #include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
-#include <set>
+#include <phosg/Time.hh>
+#include <stdexcept>
 #include <thread>
 
+#include "Color.hh"
 #include "Complex.hh"
+#include "Distributed.hh"
+#include "DoubleDouble.hh"
+#include "Encode.hh"
 #include "Iterate.hh"
 #include "JuliaSet.hh"
+#include "Pipeline.hh"
+#include "ResultBuffer.hh"
+#include "ResultCache.hh"
+#include "Roots.hh"
+#include "Server.hh"
+#include "Telemetry.hh"
 
 using namespace std;
 using namespace std::chrono_literals;
 
 
-struct Color {
-  uint8_t r, g, b;
-};
-
-vector<Color> colors({
-  {0xFF, 0x00, 0x00}, // red
-  {0xFF, 0x80, 0x00}, // orange
-  {0xFF, 0xFF, 0x00}, // yellow
-  {0x00, 0xFF, 0x00}, // green
-  {0x00, 0xFF, 0xFF}, // cyan
-  {0x00, 0x00, 0xFF}, // blue
-  {0xFF, 0x00, 0xFF}, // magenta
-  {0xFF, 0x80, 0x80}, // light red
-  {0xFF, 0xC0, 0x80}, // light orange
-  {0xFF, 0xFF, 0x80}, // light yellow
-  {0x80, 0xFF, 0x80}, // light green
-  {0x80, 0xFF, 0xFF}, // light cyan
-  {0x80, 0x80, 0xFF}, // light blue
-  {0xFF, 0x80, 0xFF}, // light magenta
-  {0x80, 0x00, 0x00}, // dark red
-  {0x80, 0x40, 0x00}, // dark orange
-  {0x80, 0x80, 0x00}, // dark yellow
-  {0x00, 0x80, 0x00}, // dark green
-  {0x00, 0x80, 0x80}, // dark cyan
-  {0x00, 0x00, 0x80}, // dark blue
-  {0x80, 0x00, 0x80}, // dark purple
-});
-
-Image color_fractal(const Image& data, int64_t min_intensity = -1,
-    int64_t max_intensity = -1, vector<ssize_t> replacement_map = vector<ssize_t>()) {
-  bool compute_min_intensity = false, compute_max_intensity = false;
-
-  if (min_intensity < 0) {
-    if (max_intensity >= 0) {
-      min_intensity = max_intensity;
-    } else {
-      data.read_pixel(0, 0, reinterpret_cast<uint64_t*>(&min_intensity), NULL, NULL);
-    }
-    compute_min_intensity = true;
-  }
-  if (max_intensity < 0) {
-    max_intensity = min_intensity;
-    compute_max_intensity = true;
-  }
-
-  // compute the min and max intensities in the entire data image
-  if (compute_min_intensity || compute_max_intensity) {
-    for (size_t y = 0; y < data.get_height(); y++) {
-      for (size_t x = 0; x < data.get_width(); x++) {
-        uint64_t depth, root_index, error;
-        data.read_pixel(x, y, &depth, &root_index, &error);
-        if (error) {
-          continue;
-        }
-
-        if (compute_max_intensity && (static_cast<int64_t>(depth) < min_intensity)) {
-          min_intensity = depth;
-        }
-        if (compute_max_intensity && (static_cast<int64_t>(depth) > max_intensity)) {
-          max_intensity = depth;
-        }
-      }
-    }
-  }
-
-  // convert the depths and root indexes into colors
-  Image result(data.get_width(), data.get_height());
-  uint64_t intensity_range = max_intensity - min_intensity;
-  for (size_t y = 0; y < data.get_height(); y++) {
-    for (size_t x = 0; x < data.get_width(); x++) {
-      uint64_t depth, root_index, error;
-      data.read_pixel(x, y, &depth, &root_index, &error);
-      if (error) {
-        result.write_pixel(x, y, 0xFF, 0xFF, 0xFF);
-        continue;
-      }
-
-      depth = (static_cast<int64_t>(depth) > max_intensity) ? max_intensity : depth;
-      depth = (static_cast<int64_t>(depth) < min_intensity) ? min_intensity : depth;
-
-      root_index = (root_index < replacement_map.size()) ? replacement_map[root_index] : root_index;
-
-      const Color& color = colors[root_index];
-      uint64_t r, g, b;
-      if (intensity_range == 0) {
-        r = (static_cast<int64_t>(depth) >= max_intensity) ? color.r : 0;
-        g = (static_cast<int64_t>(depth) >= max_intensity) ? color.g : 0;
-        b = (static_cast<int64_t>(depth) >= max_intensity) ? color.b : 0;
-      } else {
-        r = (((depth - min_intensity) * color.r) / intensity_range);
-        g = (((depth - min_intensity) * color.g) / intensity_range);
-        b = (((depth - min_intensity) * color.b) / intensity_range);
-      }
-      result.write_pixel(x, y, r, g, b);
-    }
-  }
-
-  return result;
-}
-
-
-
-vector<ssize_t> align_roots(const FractalResult& current, const FractalResult& prev) {
-  multimap<double, pair<size_t, size_t>> distance_pairs;
-  for (size_t x = 0; x < prev.roots.size(); x++) {
-    for (size_t y = 0; y < current.roots.size(); y++) {
-      complex diff = prev.roots[x] - current.roots[y];
-      distance_pairs.emplace(diff.abs2(), make_pair(x, y));
-    }
-  }
-
-  set<ssize_t> unused_root_indices;
-  for (ssize_t x = 0; x < static_cast<ssize_t>(current.roots.size()); x++) {
-    unused_root_indices.emplace(x);
-  }
-
-  vector<ssize_t> replacement_map(current.roots.size(), -1);
-  for (const auto& it : distance_pairs) {
-    const auto& rep = it.second;
-    if ((replacement_map[rep.second] < 0) && unused_root_indices.erase(rep.first)) {
-      replacement_map[rep.second] = rep.first;
-    }
-  }
-
-  // map any unassigned roots to free values
-  for (size_t x = 0; x < replacement_map.size(); x++) {
-    if (replacement_map[x] >= 0) {
-      continue;
-    }
-
-    auto it = unused_root_indices.begin();
-    replacement_map[x] = *it;
-    unused_root_indices.erase(it);
-  }
-
-  return replacement_map;
-}
-
-
-
+// Renders many frames at once. Frames are split into tiles (bands of rows),
+// which the worker threads share: each worker has its own deque of tiles, and
+// when a worker starts a frame, it puts all of that frame's tiles in its own
+// deque. Workers take tiles from the back of their own deques, and when
+// they're empty, steal from the front of the others' deques; only when there
+// are no tiles left anywhere does a worker start a new frame. So the workers
+// all help finish the frames that have been started before starting more, and
+// none of them sit idle at the end of the video. Workers don't start new frames
+// while more than ready_limit finished frames are waiting for get_result. If
+// there's a cache, frames that are in it aren't rendered, and finished frames
+// are saved to it. Frames can also be rendered by worker processes (see
+// Distributed.hh), which take whole frames from the same queue; if a worker
+// process fails, its frame goes back to the front of the queue. The buffers of
+// frames that the caller is done with can be given back with recycle, and new
+// frames reuse them; so once the pipeline is full, rendering a frame doesn't
+// allocate (and fault in) a new buffer.
 class MultiFrameRenderer {
 public:
   struct FrameMetadata {
     size_t frame_index;
-    vector<complex> frame_coeffs;
-    size_t w, h;
-    double xmin, xmax, ymin, ymax;
-    double precision, detect_precision;
-    size_t max_iterations;
-    size_t result_bit_width;
+    FractalParameters params;
+    uint64_t cache_key;
   };
 
 private:
+  struct FrameJob {
+    size_t frame_index;
+    uint64_t cache_key;
+    unique_ptr<FractalFrame> frame;
+    size_t height;
+    atomic<size_t> tiles_remaining;
+    // set when all the rows are rendered, if the frame needs supersampling;
+    // the tiles after that are for supersample_rows
+    bool supersampling;
+    uint64_t start_usecs;
+    atomic<uint64_t> cpu_usecs;
+  };
+
+  struct Tile {
+    shared_ptr<FrameJob> job;
+    size_t y_start;
+    size_t y_end;
+  };
+
+  struct WorkerQueue {
+    mutex lock;
+    deque<Tile> tiles;
+  };
+
   size_t thread_count;
   size_t ready_limit;
+  const ResultCache* cache;
+  ResultBufferPool buffer_pool;
   vector<thread> threads;
-  vector<ssize_t> worker_progress;
-
+  // for each worker, the index of the frame it's working on (or -1 if it's
+  // idle) and the number of rows it has rendered
+  vector<atomic<ssize_t>> worker_progress;
+  vector<atomic<uint64_t>> worker_rows;
+  vector<unique_ptr<WorkerQueue>> worker_queues;
+
+  // queued_tiles is only increased while holding lock, so workers waiting for
+  // it to become nonzero don't miss the notification. it's increased before
+  // the tiles are put in a queue, so it can't go below zero when they're taken.
+  // the tiles are announced (cond is notified while holding lock) after
+  // they're put in a queue, and taking the last one also notifies cond, so
+  // workers that find nothing to take while queued_tiles is nonzero can wait
+  // instead of retrying
   mutable mutex lock;
   condition_variable cond;
+  atomic<size_t> queued_tiles;
+  atomic<size_t> rows_in_progress;
   deque<FrameMetadata> pending_work;
   map<size_t, FractalResult> results;
   size_t next_result;
+  bool canceled;
+  exception_ptr exc;
+
+  // frames that have been added but aren't finished (or dropped by cancel),
+  // and how many of them worker processes are rendering. the local workers
+  // don't exit until this is zero: while a frame is being set up or finished
+  // it may have no tiles queued, but its tiles (or its supersampling tiles)
+  // are about to be, and a worker process with a frame might fail and give
+  // the frame back
+  size_t unfinished_frames;
+  size_t remote_frames_in_progress;
+  atomic<size_t> remote_worker_count;
+  thread accept_thread;
+  vector<thread> remote_threads;
+
+  // statistics for the finished frames that take_frame_stats hasn't returned
+  // yet, if enable_frame_stats was called
+  bool collect_frame_stats;
+  vector<FrameStats> frame_stats;
 
 public:
 
-  MultiFrameRenderer(size_t thread_count, size_t ready_limit) :
-      thread_count(thread_count), ready_limit(ready_limit), next_result(0) { }
+  MultiFrameRenderer(size_t thread_count, size_t ready_limit,
+      const ResultCache* cache = nullptr) : thread_count(thread_count),
+      ready_limit(ready_limit), cache(cache),
+      // enough for all the frames that are waiting for get_result or being
+      // rendered, and a few more that the caller is still using
+      buffer_pool(ready_limit + 2 * thread_count + 2), queued_tiles(0),
+      rows_in_progress(0), next_result(0), canceled(false),
+      unfinished_frames(0), remote_frames_in_progress(0),
+      remote_worker_count(0), collect_frame_stats(false) { }
 
   ~MultiFrameRenderer() {
     for (auto& t : this->threads) {
       t.join();
     }
+    if (this->accept_thread.joinable()) {
+      this->accept_thread.join();
+    }
+    // the accept thread has exited, so this doesn't change anymore
+    for (auto& t : this->remote_threads) {
+      t.join();
+    }
+  }
+
+  vector<ssize_t> get_worker_progress() const {
+    return vector<ssize_t>(this->worker_progress.begin(), this->worker_progress.end());
+  }
+
+  vector<uint64_t> get_worker_rows() const {
+    return vector<uint64_t>(this->worker_rows.begin(), this->worker_rows.end());
+  }
+
+  // the number of rows done in frames that aren't finished yet
+  size_t get_rows_in_progress() const {
+    return this->rows_in_progress;
   }
 
-  const vector<ssize_t>& get_worker_progress() const {
-    return this->worker_progress;
+  size_t get_remote_worker_count() const {
+    return this->remote_worker_count;
   }
 
   size_t work_queue_length() const {
@@ -211,98 +184,547 @@ public:
     return this->results.size();
   }
 
+  // gives back the buffer of a frame returned by get_result, so a later frame
+  // can use it
+  void recycle(ResultBuffer&& buf) {
+    this->buffer_pool.put(move(buf));
+  }
+
+  // must be called before start
+  void enable_frame_stats() {
+    this->collect_frame_stats = true;
+  }
+
+  // returns the statistics for the frames that have finished since the last
+  // call, in the order they finished
+  vector<FrameStats> take_frame_stats() {
+    unique_lock<mutex> g(this->lock);
+    vector<FrameStats> ret;
+    ret.swap(this->frame_stats);
+    return ret;
+  }
+
   void add(FrameMetadata&& m) {
     unique_lock<mutex> g(this->lock);
     this->pending_work.emplace_back(move(m));
+    this->unfinished_frames++;
+  }
+
+  // drops all frames that haven't been started yet, so the workers stop after
+  // finishing the frames in progress. get_result throws if its frame was
+  // dropped
+  void cancel() {
+    unique_lock<mutex> g(this->lock);
+    this->unfinished_frames -= this->pending_work.size();
+    this->pending_work.clear();
+    this->canceled = true;
+    this->cond.notify_all();
   }
 
   void start() {
-    this->worker_progress.resize(this->thread_count, -1);
+    this->worker_progress = vector<atomic<ssize_t>>(this->thread_count);
+    this->worker_rows = vector<atomic<uint64_t>>(this->thread_count);
+    for (auto& p : this->worker_progress) {
+      p = -1;
+    }
+    while (this->worker_queues.size() < this->thread_count) {
+      this->worker_queues.emplace_back(new WorkerQueue());
+    }
     while (this->threads.size() < this->thread_count) {
       this->threads.emplace_back(&MultiFrameRenderer::worker, this, this->threads.size());
     }
   }
 
+  // accepts connections from worker processes on listen_fd (and closes it
+  // when all the frames are done)
+  void listen(int listen_fd) {
+    this->accept_thread = thread(&MultiFrameRenderer::accept_workers, this, listen_fd);
+  }
+
+  // returns the frames in order. if a worker failed, its error is rethrown
+  // here
   FractalResult get_result() {
+    unique_lock<mutex> g(this->lock);
     for (;;) {
-      unique_lock<mutex> g(this->lock);
       auto it = this->results.find(this->next_result);
       if (it != this->results.end()) {
         this->next_result++;
         FractalResult ret = move(it->second);
         this->results.erase(it);
+        // a worker may be waiting for the results queue to get shorter
+        this->cond.notify_all();
         return ret;
       }
+      if (this->exc) {
+        rethrow_exception(this->exc);
+      }
+      if (this->canceled) {
+        throw runtime_error("rendering was canceled");
+      }
       this->cond.wait(g);
     }
   }
 
+private:
+  // fills in the statistics for a finished frame, if they're being collected
+  void make_frame_stats(FrameStats& stats, size_t frame_index,
+      const FractalResult& res, uint64_t start_usecs, uint64_t cpu_usecs,
+      bool cached, bool remote) const {
+    if (this->collect_frame_stats) {
+      stats.frame_index = frame_index;
+      stats.cached = cached;
+      stats.remote = remote;
+      stats.wall_usecs = now() - start_usecs;
+      stats.cpu_usecs = remote ? stats.wall_usecs : cpu_usecs;
+      stats.add_result(res.data);
+    }
+  }
+
+  // lock must be held
+  void finish_frame(size_t frame_index, FractalResult&& res,
+      FrameStats&& stats) {
+    if (this->collect_frame_stats) {
+      this->frame_stats.emplace_back(move(stats));
+    }
+    this->results.emplace(frame_index, move(res));
+    this->unfinished_frames--;
+    this->cond.notify_all();
+  }
+
+  // takes a tile from this worker's queue, or steals one from another
+  // worker's queue
+  bool pop_tile(size_t worker_index, Tile& tile) {
+    bool found = false;
+    for (size_t x = 0; !found && (x < this->worker_queues.size()); x++) {
+      auto& q = *this->worker_queues[(worker_index + x) % this->worker_queues.size()];
+      lock_guard<mutex> g(q.lock);
+      if (!q.tiles.empty()) {
+        // take from the top of this worker's own queue, but from the bottom of
+        // the others'
+        if (x == 0) {
+          tile = move(q.tiles.back());
+          q.tiles.pop_back();
+        } else {
+          tile = move(q.tiles.front());
+          q.tiles.pop_front();
+        }
+        found = true;
+      }
+    }
+    // workers may be waiting for the last tile to be taken, so they can start
+    // another frame
+    if (found && (--this->queued_tiles == 0)) {
+      lock_guard<mutex> g(this->lock);
+      this->cond.notify_all();
+    }
+    return found;
+  }
+
+  // returns true if any worker's queue has a tile in it. lock must be held
+  bool any_tiles_queued() const {
+    for (const auto& q : this->worker_queues) {
+      lock_guard<mutex> g(q->lock);
+      if (!q->tiles.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // puts tiles covering the whole frame (or the part of it that's rendered, if
+  // it's symmetric and not supersampling yet) in this worker's queue, and
+  // wakes the other workers to steal them. lock must not be held
+  void push_tiles(size_t worker_index, const shared_ptr<FrameJob>& job) {
+    size_t band_height = job->frame->band_height();
+    size_t height = job->supersampling ? job->height : job->frame->rendered_height();
+    size_t tile_count = (height + band_height - 1) / band_height;
+    job->tiles_remaining = tile_count;
+    {
+      lock_guard<mutex> g(this->lock);
+      this->queued_tiles += tile_count;
+    }
+
+    // push the tiles in reverse order, so this worker renders the top of the
+    // frame first and other workers steal from the bottom
+    {
+      auto& q = *this->worker_queues[worker_index];
+      lock_guard<mutex> qg(q.lock);
+      for (size_t z = tile_count; z > 0; z--) {
+        size_t y_start = (z - 1) * band_height;
+        q.tiles.push_back({job, y_start, min(y_start + band_height, height)});
+      }
+    }
+    lock_guard<mutex> g(this->lock);
+    this->cond.notify_all();
+  }
+
+  void render_tile(size_t worker_index, const Tile& tile) {
+    FrameJob& job = *tile.job;
+    uint64_t start_usecs = now();
+    if (job.supersampling) {
+      job.frame->supersample_rows(tile.y_start, tile.y_end);
+    } else {
+      job.frame->render_rows(tile.y_start, tile.y_end);
+      this->worker_rows[worker_index] += tile.y_end - tile.y_start;
+      this->rows_in_progress += tile.y_end - tile.y_start;
+    }
+    job.cpu_usecs += now() - start_usecs;
+    if (--job.tiles_remaining == 0) {
+      if (!job.supersampling) {
+        job.frame->fill_symmetric();
+      }
+      // all the rows are done; supersampling needs them all, so it's done in
+      // another round of tiles. the other workers don't exit while this frame
+      // is unfinished, so they steal these just like the first round, even if
+      // this is the last frame
+      if (!job.supersampling && job.frame->needs_supersampling()) {
+        job.supersampling = true;
+        this->push_tiles(worker_index, tile.job);
+        return;
+      }
+
+      FractalResult res = job.frame->finish();
+      if (this->cache) {
+        this->cache->save(job.cache_key, res);
+      }
+      FrameStats stats;
+      this->make_frame_stats(stats, job.frame_index, res, job.start_usecs,
+          job.cpu_usecs, false, false);
+      unique_lock<mutex> g(this->lock);
+      this->rows_in_progress -= job.frame->rendered_height();
+      this->finish_frame(job.frame_index, move(res), move(stats));
+    }
+  }
+
+  // starts the next frame and puts its tiles in this worker's queue, or just
+  // loads it if it's in the cache. g must be locked, and there must be a frame
+  // to start
+  void start_frame(size_t worker_index, unique_lock<mutex>& g) {
+    FrameMetadata fm = move(this->pending_work.front());
+    this->pending_work.pop_front();
+    g.unlock();
+
+    uint64_t start_usecs = now();
+    FractalResult cached_res;
+    if (this->cache && this->cache->load(fm.cache_key, cached_res)) {
+      FrameStats stats;
+      this->make_frame_stats(stats, fm.frame_index, cached_res, start_usecs,
+          0, true, false);
+      g.lock();
+      this->finish_frame(fm.frame_index, move(cached_res), move(stats));
+      return;
+    }
+
+    auto job = make_shared<FrameJob>();
+    job->frame_index = fm.frame_index;
+    job->cache_key = fm.cache_key;
+    job->start_usecs = start_usecs;
+    job->cpu_usecs = 0;
+    job->frame.reset(new FractalFrame(fm.params, this->buffer_pool.take(
+        fm.params.w, fm.params.h, fm.params.result_bit_width)));
+    job->height = fm.params.h;
+    job->supersampling = false;
+    this->worker_progress[worker_index] = fm.frame_index;
+
+    this->push_tiles(worker_index, job);
+    g.lock();
+  }
+
   void worker(size_t worker_index) {
-    for (;;) {
-      FrameMetadata fm;
-      {
+    try {
+      for (;;) {
+        Tile tile;
+        if (this->pop_tile(worker_index, tile)) {
+          this->worker_progress[worker_index] = tile.job->frame_index;
+          this->render_tile(worker_index, tile);
+          continue;
+        }
+
+        // there are no tiles to work on; start a new frame if possible, or
+        // wait until there's something to do
         unique_lock<mutex> g(this->lock);
-        if (this->pending_work.empty()) {
+        if (this->queued_tiles > 0) {
+          // the remaining tiles are being put in a queue or taken by other
+          // workers. if one was put in a queue since pop_tile looked, try
+          // again; otherwise, wait until one is (or the last one is taken)
+          if (!this->any_tiles_queued()) {
+            this->cond.wait(g);
+          }
+          continue;
+        }
+        if (this->exc || (this->unfinished_frames == 0)) {
           break;
         }
-        if (this->results.size() > this->ready_limit) {
-          g.unlock();
-          usleep(100000);
+        if (!this->pending_work.empty() && (this->results.size() <= this->ready_limit)) {
+          this->start_frame(worker_index, g);
           continue;
         }
-        fm = move(this->pending_work.front());
-        this->pending_work.pop_front();
+        this->worker_progress[worker_index] = -1;
+        this->cond.wait(g);
       }
+    } catch (...) {
+      unique_lock<mutex> g(this->lock);
+      if (!this->exc) {
+        this->exc = current_exception();
+      }
+      this->pending_work.clear();
+      this->cond.notify_all();
+    }
+    this->worker_progress[worker_index] = -1;
+  }
 
-      FractalResult res = julia_fractal(fm.frame_coeffs, fm.w, fm.h, fm.xmin,
-          fm.xmax, fm.ymin, fm.ymax, fm.precision, fm.detect_precision,
-          fm.max_iterations, fm.result_bit_width,
-          &this->worker_progress[worker_index]);
-
-      this->worker_progress[worker_index] = fm.h;
+  void accept_workers(int listen_fd) {
+    for (;;) {
       {
         unique_lock<mutex> g(this->lock);
-        this->results.emplace(fm.frame_index, move(res));
+        if ((this->unfinished_frames == 0) || this->canceled || this->exc) {
+          break;
+        }
+      }
+      pollfd pfd = {listen_fd, POLLIN, 0};
+      if (poll(&pfd, 1, 100) <= 0) {
+        continue;
+      }
+      try {
+        int fd = accept_socket(listen_fd);
+        unique_lock<mutex> g(this->lock);
+        this->remote_threads.emplace_back(&MultiFrameRenderer::remote_worker, this, fd);
+      } catch (const exception& e) {
+        fprintf(stderr, "warning: %s\n", e.what());
       }
-      this->cond.notify_one();
+    }
+    close(listen_fd);
+  }
 
-      this->worker_progress[worker_index] = 0;
+  // sends frames to the worker process on the other end of fd, one at a
+  // time, until there are none left
+  void remote_worker(int fd) {
+    this->remote_worker_count++;
+    bool has_frame = false;
+    try {
+      for (;;) {
+        unique_lock<mutex> g(this->lock);
+        while (!this->canceled && !this->exc && (this->unfinished_frames > 0) &&
+            (this->pending_work.empty() || (this->results.size() > this->ready_limit))) {
+          this->cond.wait(g);
+        }
+        if (this->canceled || this->exc || this->pending_work.empty()) {
+          break;
+        }
+        FrameMetadata fm = move(this->pending_work.front());
+        this->pending_work.pop_front();
+        this->remote_frames_in_progress++;
+        has_frame = true;
+        g.unlock();
+
+        uint64_t start_usecs = now();
+        FractalResult res;
+        bool cached = this->cache && this->cache->load(fm.cache_key, res);
+        if (!cached) {
+          MessageType type;
+          string data;
+          try {
+            send_message(fd, MessageType::RENDER_FRAME, serialize_parameters(fm.params));
+            if (!receive_message(fd, type, data)) {
+              throw runtime_error("connection closed");
+            }
+          } catch (const exception& e) {
+            // the worker process is gone; someone else will render the frame
+            fprintf(stderr, "worker process failed (%s); frame %zu will be rendered again\n",
+                e.what(), fm.frame_index);
+            g.lock();
+            this->remote_frames_in_progress--;
+            has_frame = false;
+            if (!this->canceled) {
+              this->pending_work.emplace_front(move(fm));
+            } else {
+              this->unfinished_frames--;
+            }
+            this->cond.notify_all();
+            break;
+          }
+          if (type == MessageType::FRAME_ERROR) {
+            throw runtime_error("worker process failed to render frame: " + data);
+          }
+          if ((type != MessageType::FRAME_RESULT) ||
+              !ResultCache::parse(fm.cache_key, res, data.data(), data.size())) {
+            throw runtime_error("worker process sent an invalid result");
+          }
+          if (this->cache) {
+            this->cache->save(fm.cache_key, res);
+          }
+        }
+
+        FrameStats stats;
+        this->make_frame_stats(stats, fm.frame_index, res, start_usecs, 0,
+            cached, !cached);
+        g.lock();
+        this->remote_frames_in_progress--;
+        has_frame = false;
+        this->finish_frame(fm.frame_index, move(res), move(stats));
+      }
+
+      // the worker process exits when the connection is closed anyway, so it
+      // doesn't matter if this fails
+      try {
+        send_message(fd, MessageType::DONE, "");
+      } catch (const exception&) { }
+
+    } catch (...) {
+      unique_lock<mutex> g(this->lock);
+      if (has_frame) {
+        this->remote_frames_in_progress--;
+      }
+      if (!this->exc) {
+        this->exc = current_exception();
+      }
+      this->pending_work.clear();
+      this->cond.notify_all();
     }
-    this->worker_progress[worker_index] = -1;
+    close(fd);
+    this->remote_worker_count--;
   }
 };
 
 
 
 void report_status_thread_fn(atomic<bool>* should_exit,
-    MultiFrameRenderer* renderer, size_t* compile_thread_frame, size_t height,
-    size_t end_frame) {
+    MultiFrameRenderer* renderer, const atomic<size_t>* compile_thread_frame,
+    size_t height, size_t end_frame) {
   while (!should_exit->load()) {
     auto worker_progresses = renderer->get_worker_progress();
     size_t lines_rendered = (*compile_thread_frame + renderer->result_queue_length()) * height;
+    lines_rendered += renderer->get_rows_in_progress();
 
     string status = "th";
-    for (ssize_t progress : worker_progresses) {
-      if (progress < 0) {
-        status += " ..../....";
+    for (ssize_t frame_index : worker_progresses) {
+      if (frame_index < 0) {
+        status += " .....";
       } else {
-        lines_rendered += progress;
-        status += string_printf(" %4zu", progress);
+        status += string_printf(" %5zd", frame_index);
       }
     }
+    size_t remote_worker_count = renderer->get_remote_worker_count();
+    if (remote_worker_count) {
+      status += string_printf(" + %zu remote", remote_worker_count);
+    }
 
-    size_t max_lines_rendered = height * end_frame;
+    size_t max_lines_rendered = height * (end_frame + 1);
     double progress = static_cast<double>(lines_rendered) / max_lines_rendered;
 
-    status += string_printf(" /%zu cm %zu/%zu rd %zu q %zu @ %g%%\n",
-        height, *compile_thread_frame, end_frame,
-        renderer->result_queue_length(), renderer->work_queue_length(),
-        progress * 100.0);
+    status += string_printf(" cm %zu/%zu rd %zu q %zu @ %g%%\n",
+        compile_thread_frame->load(), end_frame, renderer->result_queue_length(),
+        renderer->work_queue_length(), progress * 100.0);
     fwritex(stderr, status);
     usleep(1000000);
   }
 }
 
+// the state of the video pipeline outside of the renderer, for telemetry
+struct PipelineStatus {
+  const vector<size_t>* first_output_frames; // for each distinct frame
+  size_t output_frame_count;
+  const atomic<size_t>* collected_frames;
+  const atomic<size_t>* written_frames;
+  function<size_t()> color_queue_length;
+  function<size_t()> write_queue_length;
+};
+
+// writes a JSON object on its own line to fd for each finished frame (see
+// FrameStats), and one describing the whole render every interval_usecs. the
+// ETA assumes that each frame that isn't finished costs as much CPU time as
+// the closest rendered frame (since nearby frames in a video look alike), and
+// that CPU time keeps being used at the same rate as it has been so far
+void telemetry_thread_fn(atomic<bool>* should_exit,
+    MultiFrameRenderer* renderer, int fd, uint64_t interval_usecs,
+    const PipelineStatus* pipeline) {
+  uint64_t start_usecs = now();
+  uint64_t prev_usecs = start_usecs;
+  vector<uint64_t> prev_worker_rows = renderer->get_worker_rows();
+  size_t distinct_frame_count = pipeline->first_output_frames->size();
+  vector<bool> frame_finished(distinct_frame_count, false);
+  size_t finished_count = 0;
+  map<size_t, uint64_t> rendered_frame_cpu_usecs;
+  uint64_t total_cpu_usecs = 0;
+
+  for (;;) {
+    bool exiting = should_exit->load();
+    for (auto& stats : renderer->take_frame_stats()) {
+      stats.output_frame_index = (*pipeline->first_output_frames)[stats.frame_index];
+      if (!frame_finished[stats.frame_index]) {
+        frame_finished[stats.frame_index] = true;
+        finished_count++;
+      }
+      if (!stats.cached) {
+        rendered_frame_cpu_usecs[stats.frame_index] = stats.cpu_usecs;
+        total_cpu_usecs += stats.cpu_usecs;
+      }
+      if (!write_line(fd, stats.json())) {
+        return;
+      }
+    }
+
+    uint64_t now_usecs = now();
+    double interval_secs = static_cast<double>(now_usecs - prev_usecs) / 1000000;
+    double elapsed_secs = static_cast<double>(now_usecs - start_usecs) / 1000000;
+    prev_usecs = now_usecs;
+
+    string line = string_printf("{\"event\":\"%s\",\"elapsed_ms\":%.3f,"
+        "\"frames\":%zu,\"output_frames\":%zu,\"finished_frames\":%zu,"
+        "\"collected_frames\":%zu,\"written_output_frames\":%zu,"
+        "\"pending_frames\":%zu,\"ready_frames\":%zu,\"color_queue\":%zu,"
+        "\"write_queue\":%zu,\"remote_workers\":%zu,\"workers\":[",
+        exiting ? "done" : "status", elapsed_secs * 1000, distinct_frame_count,
+        pipeline->output_frame_count, finished_count,
+        pipeline->collected_frames->load(), pipeline->written_frames->load(),
+        renderer->work_queue_length(), renderer->result_queue_length(),
+        pipeline->color_queue_length(), pipeline->write_queue_length(),
+        renderer->get_remote_worker_count());
+
+    auto worker_progress = renderer->get_worker_progress();
+    auto worker_rows = renderer->get_worker_rows();
+    for (size_t x = 0; x < worker_rows.size(); x++) {
+      double rows_per_sec = (interval_secs > 0)
+          ? ((worker_rows[x] - prev_worker_rows[x]) / interval_secs) : 0;
+      line += string_printf("%s{\"frame\":%zd,\"rows\":%" PRIu64 ",\"rows_per_sec\":%.1f}",
+          x ? "," : "", worker_progress[x], worker_rows[x], rows_per_sec);
+    }
+    prev_worker_rows = move(worker_rows);
+    line += "]";
+
+    if (!exiting && !rendered_frame_cpu_usecs.empty() && (total_cpu_usecs > 0)) {
+      double remaining_cpu_usecs = 0;
+      for (size_t z = 0; z < distinct_frame_count; z++) {
+        if (frame_finished[z]) {
+          continue;
+        }
+        auto it = rendered_frame_cpu_usecs.lower_bound(z);
+        if (it == rendered_frame_cpu_usecs.end()) {
+          it--;
+        } else if (it != rendered_frame_cpu_usecs.begin()) {
+          auto prev_it = prev(it);
+          if (z - prev_it->first < it->first - z) {
+            it = prev_it;
+          }
+        }
+        remaining_cpu_usecs += it->second;
+      }
+      double cpu_usecs_per_sec = total_cpu_usecs / elapsed_secs;
+      line += string_printf(",\"eta_s\":%.1f", remaining_cpu_usecs / cpu_usecs_per_sec);
+    }
+    line += "}";
+    if (!write_line(fd, line) || exiting) {
+      return;
+    }
+
+    // wait for the next interval, but not much longer than the render
+    for (uint64_t waited = 0; (waited < interval_usecs) && !should_exit->load();
+         waited += 10000) {
+      usleep(min<uint64_t>(interval_usecs - waited, 10000));
+    }
+  }
+}
+
 
 
 
@@ -317,6 +739,12 @@ Options:\n\
       the rendered image. The default is 4 by 3, which means the left edge of\n\
       the image is x = -4, the right edge is x = +4, the top edge is y = +3,\n\
       and the bottom edge is y = -3.\n\
+  --window-center=RE,IM: move the center of the rendered image to this point\n\
+      (the default is 0,0). The coordinates may have up to about 32\n\
+      significant digits. If the window is so small that neighboring pixels\n\
+      can\'t be told apart in double precision, the image is rendered with\n\
+      double-double arithmetic instead, which is exact enough for windows down\n\
+      to about 1e-25 wide but many times slower.\n\
   --min-depth=X and --max-depth=X: specify minimum and maximum intensities. The\n\
       color of each pixel illustrates which root that position is attracted to,\n\
       and the intensity illustrates how many iterations were required to\n\
@@ -325,18 +753,99 @@ Options:\n\
       over the entire image, but this can be overridden with these options.\n\
   --bit-width=X: specify width of integers used when computing the result.\n\
       Values are 8 (default), 16, 32, and 64.\n\
+  --subdivide[=X]: don\'t compute every pixel. Instead, compute the borders of\n\
+      rectangular areas, and if all the border pixels go to the same root,\n\
+      fill in the inside without computing it. This is much faster for images\n\
+      with large basins. If X is given, the border depths may differ by up to\n\
+      X, and the inside depths are interpolated from the border; otherwise,\n\
+      the border depths must all be the same. This is a heuristic: a uniform\n\
+      border doesn\'t prove anything about the inside, so small features that\n\
+      don\'t touch a border (e.g. tiny parts of other basins) can be filled\n\
+      over with the wrong root or depth, even with X = 0.\n\
+  --progressive[=X]: when rendering a single image, render every Xth pixel\n\
+      first (default 8), then refine it in passes until every pixel is done,\n\
+      writing a preview image after each pass. The previews are written to the\n\
+      output file (each one replaces the previous one) or to stdout, before the\n\
+      final image. X must be a power of 2. Can\'t be used with --subdivide.\n\
+  --mixed-precision: iterate in single precision first, then recompute in\n\
+      double precision the pixels near basin boundaries and those that don\'t\n\
+      reach a root. The roots are the same as without this option, and the\n\
+      depths differ by at most 1. This is only faster when most of the image\n\
+      is inside large basins that converge slowly (e.g. zoomed-in views), and\n\
+      is usually a little slower otherwise; areas that don\'t converge are\n\
+      iterated twice, so they are always slower. Windows too small for single\n\
+      precision are rendered in double precision anyway, as is everything\n\
+      when not using a vector kernel (avx2 or avx512). Can\'t be used with\n\
+      --subdivide or --progressive.\n\
+  --supersample=N: anti-alias the image by taking N x N samples in each pixel\n\
+      on a basin boundary (where the root or depth changes), and coloring it\n\
+      with the average of their colors. This costs much less than rendering\n\
+      a larger image and shrinking it, since most pixels aren\'t on a\n\
+      boundary. N may be up to 16. Progressive previews aren\'t\n\
+      supersampled.\n\
   --coefficients=X1,X2,X3[@KF]: specify the expression to iterate. This option\n\
       may be given multiple times to produce a linearly-interpolated video; in\n\
       this case, all instances of this option should have a keyframe number at\n\
       the end. The examples below illustrate this usage more clearly.\n\
-  --output-filename=NAME: write output to this file (in Windows BMP format). If\n\
-      generating a video, the sequence number is appended to the output\n\
-      filename. If this option is not given, all images are written in sequence\n\
-      to stdout, which is appropriate for ffmpeg's bmp_pipe input filter.\n\
-  --thread-count=X: use this many threads to render video frames in parallel.\n\
-      If not given, use as many threads as there are CPU cores.\n\
+  --output-filename=NAME: write output to this file. If generating a video in\n\
+      bmp or png format, the sequence number is appended to the output\n\
+      filename; in y4m or raw format, all the frames go in this file. If this\n\
+      option is not given, all images are written in sequence to stdout.\n\
+  --output-format=FORMAT: write images in this format. The formats are bmp\n\
+      (Windows bitmap; the default, unless the output filename ends in one of\n\
+      the other formats\' names), png (compressed on all threads), y4m (YUV\n\
+      4:2:0, which video encoders like ffmpeg can read directly; this is the\n\
+      fastest way to send a video to an encoder, since the colors are\n\
+      converted here and the frames are half the size of the other formats),\n\
+      and raw (8-bit RGB pixels with nothing between frames, after a one-line\n\
+      header \"zroot-rgb24 WIDTH HEIGHT\" at the beginning).\n\
+  --frame-rate=N: write this frame rate in y4m streams (default 30).\n\
+  --thread-count=X: use this many threads for rendering. When rendering a\n\
+      video, each thread renders a different frame; when rendering a single\n\
+      image, the threads split up the image\'s rows. If not given, use as many\n\
+      threads as there are CPU cores.\n\
   --ready-limit=X: don\'t start new frames if there are this many waiting to be\n\
       written to the output. Useful to control memory pressure.\n\
+  --kernel=NAME: use this iteration kernel instead of the fastest one this\n\
+      CPU supports. The kernels are scalar (portable C++), asm (the SSE3\n\
+      assembly version, which is slower), avx2 and avx512. The kernel in use\n\
+      is reported on stderr at startup. Also applies to workers.\n\
+  --listen=ADDR: when rendering a video, accept connections from worker\n\
+      processes (see --worker) at this address, and have them render frames\n\
+      too. If --thread-count=0 is given, this process doesn\'t render any\n\
+      frames itself. Workers may come and go during rendering; if one fails\n\
+      or disconnects, its frame is rendered again. ADDR is either host:port\n\
+      or port for TCP, or the path of a Unix socket.\n\
+  --worker=ADDR: render frames for the process listening at this address\n\
+      (see --listen) until it has no more, then exit. Only --thread-count and\n\
+      --kernel apply to a worker; everything else comes from the listening\n\
+      process.\n\
+  --serve=ADDR: run a render server at this address instead of rendering\n\
+      anything, and keep running until killed. The server renders views for\n\
+      clients (see --server) in tiles, and keeps recently used tiles in\n\
+      memory, so views that overlap earlier ones (e.g. after panning, or\n\
+      zooming in or out by a factor of 2) only render the new parts. Only\n\
+      --thread-count, --kernel and --tile-cache-size apply to a server.\n\
+  --tile-cache-size=MB: keep up to this many megabytes of tiles in a server\n\
+      (default 1024).\n\
+  --server=ADDR: have the server at this address (see --serve) render the\n\
+      image, and color and write it here. Can only be used when rendering a\n\
+      single image, without --progressive.\n\
+  --telemetry-fd=N: when rendering a video, write JSON objects (one per line)\n\
+      describing the render to this file descriptor. There\'s one for each\n\
+      finished frame (event \"frame\"), with its wall and CPU time, iteration\n\
+      depth histogram and number of pixels that didn\'t converge (and of\n\
+      those, how many were caught in cycles), and one every second (event\n\
+      \"status\", or \"done\" at the end), with queue lengths, each\n\
+      thread\'s frame and rows per second, and an estimate of the remaining\n\
+      time. Frame numbers count repeated frames once.\n\
+  --telemetry-interval=MS: write status objects this often instead.\n\
+  --cache-directory=DIR: save each rendered frame\'s raw results in this\n\
+      directory, and use the saved results instead of rendering frames that\n\
+      are already there. This allows an interrupted video to be resumed, and\n\
+      allows images to be colored again (e.g. with different --min-depth or\n\
+      --max-depth options) without rendering them again. Entries are about\n\
+      (bit width / 8 + 1) bytes per pixel and are never deleted automatically.\n\
 \n\
 Examples:\n\
   Render Julia set for x^3 - i:\n\
@@ -346,12 +855,19 @@ Examples:\n\
         --coefficients=1,0,0,0,0,-i@120 --output-filename=output_frame.bmp\n\
   Animate transition from x^3 - i to x^4 - i and directly encode into a video:\n\
     %s --coefficients=1,0,0,-i@0 --coefficients=1,0,0,0,-i@60 \\\n\
-        | ffmpeg -r 30 -f bmp_pipe -i - -c:v libx264 -crf 0 -r 30 output.avi\n\
+        --output-format=y4m | ffmpeg -i - -c:v libx264 -crf 0 output.avi\n\
 ", argv0, argv0, argv0, argv0);
 }
 
+static void report_iteration_kernel() {
+  IterationKernel kernel = get_iteration_kernel();
+  fprintf(stderr, "using %s kernel%s\n", name_for_iteration_kernel(kernel),
+      (kernel == default_iteration_kernel()) ? "" : " (overridden)");
+}
+
 int main(int argc, char* argv[]) {
   double xmin = -4.0, ymin = -3.0, xmax = 4.0, ymax = 3.0;
+  DoubleDouble center_re = {0.0, 0.0}, center_im = {0.0, 0.0};
   double precision = 0.0000001; // calculation precision
   double detect_precision = 0.0001; // detection precision (must be less precise than calc precision)
   size_t max_iterations = 100; // speed for fail points (higher is slower)
@@ -360,10 +876,24 @@ int main(int argc, char* argv[]) {
   int64_t min_intensity = -1, max_intensity = -1;
   map<size_t, vector<complex>> keyframe_to_coeffs;
   size_t max_coeffs = 0;
-  size_t thread_count = 0;
+  ssize_t thread_count = -1;
   ssize_t ready_limit = -1;
   size_t result_bit_width = 8;
+  ssize_t subdivide_tolerance = -1;
+  size_t progressive_step = 0;
+  bool mixed_precision = false;
+  size_t supersample = 1;
   const char* output_filename = NULL;
+  const char* output_format_name = NULL;
+  uint64_t frame_rate = 30;
+  const char* cache_directory = NULL;
+  const char* listen_address = NULL;
+  const char* worker_address = NULL;
+  const char* serve_address = NULL;
+  const char* server_address = NULL;
+  size_t tile_cache_mb = 1024;
+  int telemetry_fd = -1;
+  uint64_t telemetry_interval_usecs = 1000000;
   for (int x = 1; x < argc; x++) {
 
     if (!strncmp(argv[x], "--width=", 8)) {
@@ -377,6 +907,18 @@ int main(int argc, char* argv[]) {
     } else if (!strncmp(argv[x], "--window-height=", 16)) {
       ymin = atof(&argv[x][16]) / 2;
       ymax = -ymin;
+    } else if (!strncmp(argv[x], "--window-center=", 16)) {
+      auto tokens = split(&argv[x][16], ',');
+      try {
+        if (tokens.size() != 2) {
+          throw invalid_argument("expected two numbers");
+        }
+        center_re = DoubleDouble::parse(tokens[0].c_str());
+        center_im = DoubleDouble::parse(tokens[1].c_str());
+      } catch (const invalid_argument& e) {
+        fprintf(stderr, "invalid window center: %s (%s)\n", argv[x], e.what());
+        return 1;
+      }
 
     } else if (!strncmp(argv[x], "--min-depth=", 12)) {
       min_intensity = atoi(&argv[x][12]);
@@ -408,13 +950,52 @@ int main(int argc, char* argv[]) {
 
     } else if (!strncmp(argv[x], "--output-filename=", 18)) {
       output_filename = &argv[x][18];
+    } else if (!strncmp(argv[x], "--output-format=", 16)) {
+      output_format_name = &argv[x][16];
+    } else if (!strncmp(argv[x], "--frame-rate=", 13)) {
+      frame_rate = atoi(&argv[x][13]);
+    } else if (!strncmp(argv[x], "--cache-directory=", 18)) {
+      cache_directory = &argv[x][18];
+    } else if (!strncmp(argv[x], "--listen=", 9)) {
+      listen_address = &argv[x][9];
+    } else if (!strncmp(argv[x], "--worker=", 9)) {
+      worker_address = &argv[x][9];
+    } else if (!strncmp(argv[x], "--serve=", 8)) {
+      serve_address = &argv[x][8];
+    } else if (!strncmp(argv[x], "--server=", 9)) {
+      server_address = &argv[x][9];
+    } else if (!strncmp(argv[x], "--tile-cache-size=", 18)) {
+      tile_cache_mb = atoi(&argv[x][18]);
+    } else if (!strncmp(argv[x], "--telemetry-fd=", 15)) {
+      telemetry_fd = atoi(&argv[x][15]);
+    } else if (!strncmp(argv[x], "--telemetry-interval=", 21)) {
+      telemetry_interval_usecs = atoi(&argv[x][21]) * 1000ULL;
 
     } else if (!strncmp(argv[x], "--thread-count=", 15)) {
       thread_count = atoi(&argv[x][15]);
+    } else if (!strncmp(argv[x], "--kernel=", 9)) {
+      try {
+        set_iteration_kernel(iteration_kernel_for_name(&argv[x][9]));
+      } catch (const invalid_argument& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+      }
     } else if (!strncmp(argv[x], "--ready-limit=", 14)) {
       ready_limit = atoi(&argv[x][14]);
     } else if (!strncmp(argv[x], "--bit-width=", 12)) {
       result_bit_width = atoi(&argv[x][12]);
+    } else if (!strcmp(argv[x], "--subdivide")) {
+      subdivide_tolerance = 0;
+    } else if (!strncmp(argv[x], "--subdivide=", 12)) {
+      subdivide_tolerance = atoi(&argv[x][12]);
+    } else if (!strcmp(argv[x], "--progressive")) {
+      progressive_step = 8;
+    } else if (!strncmp(argv[x], "--progressive=", 14)) {
+      progressive_step = atoi(&argv[x][14]);
+    } else if (!strcmp(argv[x], "--mixed-precision")) {
+      mixed_precision = true;
+    } else if (!strncmp(argv[x], "--supersample=", 14)) {
+      supersample = atoi(&argv[x][14]);
 
     } else {
       fprintf(stderr, "unknown command-line option: %s\n", argv[x]);
@@ -422,30 +1003,148 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  if (thread_count == 0) {
+  // a coordinator may leave all the rendering to worker processes
+  if ((thread_count < 0) || ((thread_count == 0) && !listen_address)) {
     thread_count = thread::hardware_concurrency();
   }
+  if (worker_address) {
+    report_iteration_kernel();
+    run_worker(worker_address, thread_count);
+    return 0;
+  }
+  if (serve_address) {
+    report_iteration_kernel();
+    run_server(serve_address, thread_count, tile_cache_mb << 20);
+    return 0;
+  }
+  if (server_address && ((keyframe_to_coeffs.size() != 1) || progressive_step)) {
+    fprintf(stderr, "--server can only be used when rendering a single image without --progressive\n");
+    return 1;
+  }
+  if (listen_address && (keyframe_to_coeffs.size() == 1)) {
+    fprintf(stderr, "--listen can only be used when rendering a video\n");
+    return 1;
+  }
+  if ((telemetry_fd >= 0) && (keyframe_to_coeffs.size() == 1)) {
+    fprintf(stderr, "--telemetry-fd can only be used when rendering a video\n");
+    return 1;
+  }
+  if (progressive_step & (progressive_step - 1)) {
+    fprintf(stderr, "--progressive step must be a power of 2\n");
+    return 1;
+  }
+  if (progressive_step && (subdivide_tolerance >= 0)) {
+    fprintf(stderr, "--progressive and --subdivide can't be used together\n");
+    return 1;
+  }
+  if (progressive_step && (keyframe_to_coeffs.size() > 1)) {
+    fprintf(stderr, "--progressive can only be used when rendering a single image\n");
+    return 1;
+  }
+  if (mixed_precision && (progressive_step || (subdivide_tolerance >= 0))) {
+    fprintf(stderr, "--mixed-precision can't be used with --progressive or --subdivide\n");
+    return 1;
+  }
+  if ((supersample < 1) || (supersample > 16)) {
+    fprintf(stderr, "--supersample must be between 1 and 16\n");
+    return 1;
+  }
+  OutputFormat output_format = output_filename
+      ? output_format_for_filename(output_filename, OutputFormat::BMP)
+      : OutputFormat::BMP;
+  if (output_format_name) {
+    try {
+      output_format = output_format_for_name(output_format_name);
+    } catch (const invalid_argument& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  if (frame_rate == 0) {
+    fprintf(stderr, "--frame-rate must be positive\n");
+    return 1;
+  }
+
+  FractalParameters base_params;
+  base_params.w = w;
+  base_params.h = h;
+  // the center is added in double-double precision, so the window can be much
+  // smaller than the center's distance from the origin
+  DoubleDouble window_xmin = center_re + DoubleDouble::from_double(xmin);
+  DoubleDouble window_xmax = center_re + DoubleDouble::from_double(xmax);
+  DoubleDouble window_ymin = center_im + DoubleDouble::from_double(ymin);
+  DoubleDouble window_ymax = center_im + DoubleDouble::from_double(ymax);
+  base_params.xmin = window_xmin.hi;
+  base_params.xmax = window_xmax.hi;
+  base_params.ymin = window_ymin.hi;
+  base_params.ymax = window_ymax.hi;
+  base_params.xmin_low = window_xmin.lo;
+  base_params.xmax_low = window_xmax.lo;
+  base_params.ymin_low = window_ymin.lo;
+  base_params.ymax_low = window_ymax.lo;
+  base_params.precision = precision;
+  base_params.detect_precision = detect_precision;
+  base_params.max_iterations = max_iterations;
+  base_params.result_bit_width = result_bit_width;
+  base_params.subdivide_tolerance = subdivide_tolerance;
+  base_params.progressive_step = progressive_step;
+  base_params.mixed_precision = mixed_precision;
+  base_params.supersample = supersample;
   if (ready_limit < 0) {
-    ready_limit = 2 * thread_count;
+    // worker processes finish frames out of order too, so a coordinator
+    // allows more frames to wait
+    ready_limit = listen_address ? max<ssize_t>(2 * thread_count, 32) : (2 * thread_count);
+  }
+  unique_ptr<ResultCache> cache;
+  if (cache_directory) {
+    cache.reset(new ResultCache(cache_directory));
   }
 
   if (keyframe_to_coeffs.empty()) {
     print_usage(argv[0]);
     return 1;
+  }
+  report_iteration_kernel();
 
-  } else if (keyframe_to_coeffs.size() == 1) {
+  if (keyframe_to_coeffs.size() == 1) {
     // rendering a single image
     auto it = *keyframe_to_coeffs.begin();
-    ssize_t progress;
-    FractalResult result = julia_fractal(it.second, w, h, xmin, xmax, ymin,
-        ymax, precision, detect_precision, max_iterations, result_bit_width,
-        &progress);
-    Image img = color_fractal(result.data, min_intensity, max_intensity);
-    if (output_filename) {
-      img.save(output_filename, Image::Format::WINDOWS_BITMAP);
-    } else {
-      img.save(stdout, Image::Format::WINDOWS_BITMAP);
+    FractalParameters params = base_params;
+    params.coeffs = it.second;
+    // in a stream format, progressive previews go to stdout as frames of
+    // one stream, so the header is only written once there
+    bool wrote_stream_header = false;
+    auto write_image = [&](const FractalResult& result) {
+      Image img = color_fractal(result, min_intensity, max_intensity,
+          thread_count);
+      string data = encode_frame(img, output_format, thread_count);
+      if (output_filename || !wrote_stream_header) {
+        data = encode_stream_header(output_format, w, h, frame_rate) + data;
+        wrote_stream_header = true;
+      }
+      if (output_filename) {
+        save_file(output_filename, data);
+      } else {
+        fwritex(stdout, data);
+        fflush(stdout);
+      }
+    };
+    FractalResult result;
+    uint64_t cache_key = ResultCache::key(params);
+    if (server_address) {
+      result = request_render(server_address, params);
+    } else if (!cache || !cache->load(cache_key, result)) {
+      RenderOptions options;
+      options.thread_count = thread_count;
+      if (progressive_step) {
+        options.on_pass = write_image;
+      }
+      result = julia_fractal(params, options);
+      if (cache) {
+        cache->save(cache_key, result);
+      }
     }
+    write_image(result);
 
   } else {
     // rendering a video (or sequence of images)
@@ -461,82 +1160,206 @@ int main(int argc, char* argv[]) {
     auto next_kf_it = kf_it;
     advance(next_kf_it, 1);
 
-    MultiFrameRenderer renderer(thread_count, ready_limit);
+    // the roots are followed from each frame to the next, so each one keeps its
+    // color for as long as it exists. when consecutive frames are the same
+    // (e.g. while holding a keyframe), only the first one is rendered and
+    // encoded, and it's written out frame_repeat_counts[x] times; the renderer
+    // and the color threads number only these distinct frames
+    MultiFrameRenderer renderer(thread_count, ready_limit, cache.get());
+    RootTracker root_tracker;
     size_t end_frame = keyframe_to_coeffs.rbegin()->first;
+    vector<size_t> frame_repeat_counts;
+    uint64_t prev_cache_key = 0;
     for (size_t frame = 0; frame <= end_frame; frame++) {
 
       MultiFrameRenderer::FrameMetadata fm;
-      fm.frame_index = frame;
-      fm.w = w;
-      fm.h = h;
-      fm.xmin = xmin;
-      fm.xmax = xmax;
-      fm.ymin = ymin;
-      fm.ymax = ymax;
-      fm.precision = precision;
-      fm.detect_precision = detect_precision;
-      fm.max_iterations = max_iterations;
-      fm.result_bit_width = result_bit_width;
+      fm.frame_index = frame_repeat_counts.size();
+      fm.params = base_params;
       if ((next_kf_it != keyframe_to_coeffs.end()) && (frame == next_kf_it->first)) {
         kf_it++;
         next_kf_it++;
-        fm.frame_coeffs = kf_it->second;
+        fm.params.coeffs = kf_it->second;
+
+      } else if (kf_it->second == next_kf_it->second) {
+        // hold the keyframe exactly, so the frames are all the same
+        fm.params.coeffs = kf_it->second;
 
       } else {
         // linearly interpolate coeffs between the keyframes
         size_t interval_frames = next_kf_it->first - kf_it->first;
         size_t progress = frame - kf_it->first;
         for (size_t x = 0; x < kf_it->second.size(); x++) {
-          fm.frame_coeffs.emplace_back(((next_kf_it->second[x] * progress) + (kf_it->second[x] * (interval_frames - progress))) / interval_frames);
+          fm.params.coeffs.emplace_back(((next_kf_it->second[x] * progress) + (kf_it->second[x] * (interval_frames - progress))) / interval_frames);
         }
       }
 
+      root_tracker.update(fm.params.coeffs);
+      fm.params.roots = root_tracker.get_roots();
+      fm.params.root_colors = root_tracker.get_ids();
+
+      fm.cache_key = ResultCache::key(fm.params);
+      if (!frame_repeat_counts.empty() && (fm.cache_key == prev_cache_key)) {
+        frame_repeat_counts.back()++;
+        continue;
+      }
+      prev_cache_key = fm.cache_key;
+      frame_repeat_counts.emplace_back(1);
       renderer.add(move(fm));
     }
+    size_t distinct_frame_count = frame_repeat_counts.size();
 
+    if (listen_address) {
+      renderer.listen(listen_socket(listen_address));
+    }
+    if (telemetry_fd >= 0) {
+      renderer.enable_frame_stats();
+    }
     renderer.start();
 
-    size_t frame = 0;
-    atomic<bool> should_exit(false);
-    thread status_thread(&report_status_thread_fn, &should_exit, &renderer,
-        &frame, h, end_frame);
+    // after the frames are rendered, they go through a pipeline: this thread
+    // collects them in order, a pool of threads colors and encodes them, and
+    // another thread writes them to the output. each stage has a bounded queue
+    // in front of it, so rendering only stalls on a slow output once all the
+    // queues are full
+    struct OutputFrame {
+      size_t frame_index;
+      FractalResult result;
+    };
+    size_t output_thread_count = max<size_t>(thread_count / 4, 1);
+    BoundedQueue<OutputFrame> color_queue(output_thread_count);
+    ReorderBuffer<string> write_buffer(2 * output_thread_count);
+
+    // if any stage fails, all the stages are stopped and the error is rethrown
+    // here after they've all finished
+    exception_ptr exc;
+    mutex exc_lock;
+    auto fail = [&]() {
+      lock_guard<mutex> g(exc_lock);
+      if (!exc) {
+        exc = current_exception();
+      }
+      color_queue.close();
+      write_buffer.close();
+      renderer.cancel();
+    };
+
+    auto color_thread_fn = [&]() {
+      try {
+        // each thread colors all its frames into the same image, and gives
+        // the results back to the renderer when it's done with them
+        OutputFrame of;
+        Image img;
+        while (color_queue.pop(of)) {
+          color_fractal(img, of.result.data, min_intensity, max_intensity,
+              of.result.root_colors, 1, &of.result.supersamples);
+          renderer.recycle(move(of.result.data));
+          write_buffer.put(of.frame_index, encode_frame(img, output_format));
+        }
+      } catch (...) {
+        fail();
+      }
+    };
+
+    // in a stream format, all the frames go to one file (or stdout) after a
+    // single header; otherwise each frame is its own file
+    atomic<size_t> written_frames(0);
+    auto write_thread_fn = [&]() {
+      try {
+        bool is_stream = is_stream_output_format(output_format);
+        unique_ptr<FILE, int(*)(FILE*)> stream_file(nullptr, fclose);
+        FILE* out = stdout;
+        if (output_filename && is_stream) {
+          stream_file.reset(fopen(output_filename, "wb"));
+          if (!stream_file) {
+            throw runtime_error(string_printf("can\'t open %s: %s",
+                output_filename, strerror(errno)));
+          }
+          out = stream_file.get();
+        }
+        fwritex(out, encode_stream_header(output_format, w, h, frame_rate));
+
+        string extension = string(".") + name_for_output_format(output_format);
+        string data;
+        for (size_t x = 0; (x < distinct_frame_count) && write_buffer.get(data); x++) {
+          for (size_t r = 0; r < frame_repeat_counts[x]; r++, written_frames++) {
+            size_t frame = written_frames;
+            if (output_filename && !is_stream) {
+              string numbered_filename = output_filename;
+              if (ends_with(numbered_filename, extension)) {
+                numbered_filename = numbered_filename.substr(0, numbered_filename.size() - extension.size()) + string_printf(".%zu", frame) + extension;
+              } else {
+                numbered_filename += string_printf(".%zu", frame);
+              }
+              save_file(numbered_filename, data);
+            } else {
+              fwritex(out, data);
+              fflush(out);
+            }
+          }
+        }
+        if (stream_file && fflush(stream_file.get())) {
+          throw runtime_error(string_printf("can\'t write %s: %s",
+              output_filename, strerror(errno)));
+        }
+      } catch (...) {
+        fail();
+      }
+    };
 
-    FractalResult prev_result = {vector<complex>(), Image(0, 0)};
-    for (frame = 0; frame <= end_frame; frame++) {
-      FractalResult result = renderer.get_result();
+    vector<thread> output_threads;
+    for (size_t x = 0; x < output_thread_count; x++) {
+      output_threads.emplace_back(color_thread_fn);
+    }
+    output_threads.emplace_back(write_thread_fn);
 
-      vector<ssize_t> replacement_map;
-      if (!prev_result.roots.empty()) {
-        replacement_map = align_roots(result, prev_result);
-      }
-      Image img = color_fractal(result.data, min_intensity, max_intensity,
-          replacement_map);
+    atomic<size_t> frame(0);
+    atomic<bool> should_exit(false);
+    thread status_thread(&report_status_thread_fn, &should_exit, &renderer,
+        &frame, h, distinct_frame_count - 1);
 
-      // reorder the roots so the next frame will make sense
-      vector<complex> new_roots(result.roots.size());
-      for (size_t x = 0; x < replacement_map.size(); x++) {
-        new_roots[replacement_map[x]] = result.roots[x];
-      }
-      result.roots = move(new_roots);
+    vector<size_t> first_output_frames;
+    size_t output_frame_count = 0;
+    for (size_t count : frame_repeat_counts) {
+      first_output_frames.emplace_back(output_frame_count);
+      output_frame_count += count;
+    }
+    PipelineStatus pipeline_status = {&first_output_frames, output_frame_count,
+        &frame, &written_frames, [&]() { return color_queue.size(); },
+        [&]() { return write_buffer.size(); }};
+    thread telemetry_thread;
+    if (telemetry_fd >= 0) {
+      telemetry_thread = thread(&telemetry_thread_fn, &should_exit, &renderer,
+          telemetry_fd, telemetry_interval_usecs, &pipeline_status);
+    }
 
-      if (output_filename) {
-        string numbered_filename = output_filename;
-        if (ends_with(numbered_filename, ".bmp")) {
-          numbered_filename = numbered_filename.substr(0, numbered_filename.size() - 4) + string_printf(".%zu.bmp", frame);
-        } else {
-          numbered_filename += string_printf(".%zu", frame);
+    try {
+      for (frame = 0; frame < distinct_frame_count; frame++) {
+        FractalResult result = renderer.get_result();
+        {
+          lock_guard<mutex> g(exc_lock);
+          if (exc) {
+            break;
+          }
         }
-        img.save(numbered_filename.c_str(), Image::Format::WINDOWS_BITMAP);
-      } else {
-        img.save(stdout, Image::Format::WINDOWS_BITMAP);
+        color_queue.push({frame.load(), move(result)});
       }
-
-      prev_result = move(result);
+    } catch (...) {
+      fail();
+    }
+    color_queue.close();
+    for (auto& t : output_threads) {
+      t.join();
     }
 
     should_exit.store(true);
     status_thread.join();
+    if (telemetry_thread.joinable()) {
+      telemetry_thread.join();
+    }
     fputc('\n', stderr);
+    if (exc) {
+      rethrow_exception(exc);
+    }
   }
 
   return 0;
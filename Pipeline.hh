@@ -0,0 +1,287 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A FIFO queue with a maximum size, for passing items between pipeline stages.
+// push() blocks while the queue is full, and pop() blocks while it's empty.
+// After close() is called, push() drops its item and pop() returns false once
+// the queue is empty; this is used both for normal shutdown and for stopping
+// the other stages when one of them fails.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t max_size) : max_size(max_size), closed(false) { }
+
+  void push(T&& item) {
+    std::unique_lock<std::mutex> g(this->lock);
+    while (!this->closed && (this->items.size() >= this->max_size)) {
+      this->not_full.wait(g);
+    }
+    if (this->closed) {
+      return;
+    }
+    this->items.emplace_back(std::move(item));
+    this->not_empty.notify_one();
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> g(this->lock);
+    while (!this->closed && this->items.empty()) {
+      this->not_empty.wait(g);
+    }
+    if (this->items.empty()) {
+      return false;
+    }
+    item = std::move(this->items.front());
+    this->items.pop_front();
+    this->not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> g(this->lock);
+    this->closed = true;
+    this->not_full.notify_all();
+    this->not_empty.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> g(this->lock);
+    return this->items.size();
+  }
+
+private:
+  size_t max_size;
+  bool closed;
+  std::deque<T> items;
+  mutable std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+// Puts items that are produced out of order (e.g. by several threads) back in
+// order. Items are numbered consecutively from zero; get() returns them in
+// that order, blocking until the next one is available. put() blocks while the
+// item is too far ahead of the next one to be returned, so memory use is
+// bounded, but never for the next item itself, so this can't deadlock. close()
+// behaves as for BoundedQueue.
+template <typename T>
+class ReorderBuffer {
+public:
+  explicit ReorderBuffer(size_t max_ahead) : max_ahead(max_ahead),
+      next_index(0), closed(false) { }
+
+  void put(size_t index, T&& item) {
+    std::unique_lock<std::mutex> g(this->lock);
+    while (!this->closed && (index >= this->next_index + this->max_ahead)) {
+      this->cond.wait(g);
+    }
+    if (this->closed) {
+      return;
+    }
+    this->items.emplace(index, std::move(item));
+    this->cond.notify_all();
+  }
+
+  bool get(T& item) {
+    std::unique_lock<std::mutex> g(this->lock);
+    for (;;) {
+      auto it = this->items.find(this->next_index);
+      if (it != this->items.end()) {
+        item = std::move(it->second);
+        this->items.erase(it);
+        this->next_index++;
+        this->cond.notify_all();
+        return true;
+      }
+      if (this->closed) {
+        return false;
+      }
+      this->cond.wait(g);
+    }
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> g(this->lock);
+    this->closed = true;
+    this->cond.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> g(this->lock);
+    return this->items.size();
+  }
+
+private:
+  size_t max_ahead;
+  size_t next_index;
+  bool closed;
+  std::map<size_t, T> items;
+  mutable std::mutex lock;
+  std::condition_variable cond;
+};
+
+// A fixed set of threads that run tasks for any number of callers, so that
+// several renders at once (e.g. in a server) share the CPUs instead of each
+// starting its own threads. run_all queues a group of tasks and returns when
+// they're all done; the calling thread runs queued tasks too while it waits,
+// so a task may call run_all itself without deadlocking the pool.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t thread_count) : stopping(false) {
+    for (size_t x = 0; x < thread_count; x++) {
+      this->threads.emplace_back(&ThreadPool::run_tasks, this);
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> g(this->lock);
+      this->stopping = true;
+    }
+    this->cond.notify_all();
+    for (auto& t : this->threads) {
+      t.join();
+    }
+  }
+
+  size_t size() const {
+    return this->threads.size();
+  }
+
+  // if any of fns throws, the first exception is rethrown here after all of
+  // them are done
+  void run_all(std::vector<std::function<void()>>& fns) {
+    auto group = std::make_shared<Group>();
+    group->remaining = fns.size();
+    {
+      std::lock_guard<std::mutex> g(this->lock);
+      for (auto& fn : fns) {
+        this->tasks.emplace_back(Task{group, std::move(fn)});
+      }
+    }
+    this->cond.notify_all();
+
+    std::unique_lock<std::mutex> g(this->lock);
+    while (group->remaining) {
+      if (!this->tasks.empty()) {
+        Task task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        g.unlock();
+        this->run_task(task);
+        g.lock();
+      } else {
+        this->cond.wait(g);
+      }
+    }
+    if (group->error) {
+      std::rethrow_exception(group->error);
+    }
+  }
+
+private:
+  struct Group {
+    size_t remaining;
+    std::exception_ptr error;
+  };
+  struct Task {
+    std::shared_ptr<Group> group;
+    std::function<void()> fn;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  // notified when a task is queued or a group finishes
+  std::condition_variable cond;
+  std::deque<Task> tasks;
+  bool stopping;
+
+  void run_task(Task& task) {
+    std::exception_ptr error;
+    try {
+      task.fn();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> g(this->lock);
+    if (error && !task.group->error) {
+      task.group->error = error;
+    }
+    if (--task.group->remaining == 0) {
+      this->cond.notify_all();
+    }
+  }
+
+  void run_tasks() {
+    std::unique_lock<std::mutex> g(this->lock);
+    for (;;) {
+      if (!this->tasks.empty()) {
+        Task task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        g.unlock();
+        this->run_task(task);
+        g.lock();
+      } else if (this->stopping) {
+        return;
+      } else {
+        this->cond.wait(g);
+      }
+    }
+  }
+};
+
+// splits the rows [0, h) into one band for each thread and calls fn(y_start,
+// y_end) for each band (on the calling thread, if there's only one). if fn
+// throws, the first exception is rethrown here after all the bands are done
+template <typename FnT>
+void for_each_band(size_t h, size_t thread_count, FnT&& fn) {
+  thread_count = std::min(thread_count, h);
+  if (thread_count <= 1) {
+    fn(0, h);
+    return;
+  }
+  std::exception_ptr error;
+  std::mutex error_lock;
+  auto run_band = [&](size_t y_start, size_t y_end) {
+    try {
+      fn(y_start, y_end);
+    } catch (...) {
+      std::lock_guard<std::mutex> g(error_lock);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  try {
+    for (size_t x = 0; x < thread_count; x++) {
+      threads.emplace_back(run_band, (h * x) / thread_count, (h * (x + 1)) / thread_count);
+    }
+  } catch (...) {
+    // couldn't start a thread; the ones already running must still be joined
+    for (auto& t : threads) {
+      t.join();
+    }
+    throw;
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,103 @@
+#include "Polynomial.hh"
+
+#include <array>
+#include <utility>
+
+using namespace std;
+
+
+template <size_t Degree, size_t I>
+static inline void horner_step(complex& p, complex& dp, const complex* coeffs,
+    const complex* deriv_coeffs, const complex& z) {
+  p = p * z + coeffs[I + 1];
+  if constexpr (I + 1 < Degree) {
+    dp = dp * z + deriv_coeffs[I + 1];
+  }
+}
+
+template <size_t Degree, size_t... I>
+static inline complex step_unrolled(const complex* coeffs,
+    const complex* deriv_coeffs, const complex& z, index_sequence<I...>) {
+  complex p = coeffs[0];
+  complex dp = deriv_coeffs[0];
+  (horner_step<Degree, I>(p, dp, coeffs, deriv_coeffs, z), ...);
+  return p / dp;
+}
+
+template <size_t Degree>
+static complex step_for_degree(const complex* coeffs,
+    const complex* deriv_coeffs, size_t, const complex& z) {
+  return step_unrolled<Degree>(coeffs, deriv_coeffs, z,
+      make_index_sequence<Degree>());
+}
+
+static complex step_generic(const complex* coeffs,
+    const complex* deriv_coeffs, size_t degree, const complex& z) {
+  complex p = coeffs[0];
+  complex dp = deriv_coeffs[0];
+  for (size_t x = 1; x <= degree; x++) {
+    p = p * z + coeffs[x];
+    if (x < degree) {
+      dp = dp * z + deriv_coeffs[x];
+    }
+  }
+  return p / dp;
+}
+
+template <size_t... Degrees>
+static constexpr array<Polynomial::StepFunction, sizeof...(Degrees) + 1>
+make_step_functions(index_sequence<Degrees...>) {
+  return {{&step_generic, &step_for_degree<Degrees + 1>...}};
+}
+
+// step_functions[d] is the unrolled step function for degree d; degree 0 (a
+// constant, which has no roots) just uses the generic loop
+static constexpr auto step_functions = make_step_functions(
+    make_index_sequence<Polynomial::MAX_UNROLLED_DEGREE>());
+
+
+
+Polynomial::Polynomial(const vector<complex>& coeffs) {
+  // leading zeroes don't change anything except the amount of work, so skip
+  // them (video frames have them when interpolating between degrees)
+  size_t start = 0;
+  while ((start + 1 < coeffs.size()) && (coeffs[start] == complex())) {
+    start++;
+  }
+  this->coeffs.assign(coeffs.begin() + start, coeffs.end());
+  if (this->coeffs.empty()) {
+    this->coeffs.emplace_back();
+  }
+
+  size_t degree = this->degree();
+  for (size_t x = 0; x < degree; x++) {
+    this->deriv_coeffs.emplace_back(this->coeffs[x] * static_cast<double>(degree - x));
+  }
+  if (this->deriv_coeffs.empty()) {
+    this->deriv_coeffs.emplace_back();
+  }
+
+  this->split_data.reserve(2 * (this->coeffs.size() + this->deriv_coeffs.size()));
+  for (const auto& c : this->coeffs) {
+    this->split_data.emplace_back(c.real);
+  }
+  for (const auto& c : this->coeffs) {
+    this->split_data.emplace_back(c.imag);
+  }
+  for (const auto& c : this->deriv_coeffs) {
+    this->split_data.emplace_back(c.real);
+  }
+  for (const auto& c : this->deriv_coeffs) {
+    this->split_data.emplace_back(c.imag);
+  }
+
+  this->step_fn = (degree <= MAX_UNROLLED_DEGREE) ? step_functions[degree] : step_generic;
+}
+
+SplitCoefficients Polynomial::split() const {
+  size_t count = this->coeffs.size();
+  size_t deriv_count = this->deriv_coeffs.size();
+  const double* data = this->split_data.data();
+  return {data, data + count, data + 2 * count, data + 2 * count + deriv_count,
+      this->degree()};
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "Complex.hh"
+
+
+// The coefficients of p and p' as separate arrays of real and imaginary parts,
+// highest degree first. This is the form the vector kernels use. (For a
+// constant polynomial, the derivative has a single zero coefficient.)
+struct SplitCoefficients {
+  const double* real;
+  const double* imag;
+  const double* deriv_real;
+  const double* deriv_imag;
+  size_t degree;
+};
+
+// A polynomial prepared for Newton's method. This is built once per frame; it
+// precomputes the coefficients of the derivative so the inner loop only has to
+// evaluate p and p' with Horner's method, and for degrees up to
+// MAX_UNROLLED_DEGREE it uses a version of that loop unrolled for the degree.
+class Polynomial {
+public:
+  static constexpr size_t MAX_UNROLLED_DEGREE = 17;
+
+  explicit Polynomial(const std::vector<complex>& coeffs);
+
+  inline size_t degree() const {
+    return this->coeffs.size() - 1;
+  }
+  // highest degree first, without any leading zeroes
+  inline const std::vector<complex>& get_coeffs() const {
+    return this->coeffs;
+  }
+  // highest degree first; always has at least one coefficient
+  inline const std::vector<complex>& get_deriv_coeffs() const {
+    return this->deriv_coeffs;
+  }
+  SplitCoefficients split() const;
+
+  // returns p(z) / p'(z), so one Newton step is z - step(z)
+  inline complex step(const complex& z) const {
+    return this->step_fn(this->coeffs.data(), this->deriv_coeffs.data(),
+        this->degree(), z);
+  }
+
+  using StepFunction = complex (*)(const complex* coeffs,
+      const complex* deriv_coeffs, size_t degree, const complex& z);
+
+private:
+  std::vector<complex> coeffs;
+  std::vector<complex> deriv_coeffs;
+  std::vector<double> split_data;
+  StepFunction step_fn;
+};
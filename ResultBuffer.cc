@@ -0,0 +1,112 @@
+#include "ResultBuffer.hh"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <new>
+#include <stdexcept>
+
+using namespace std;
+
+
+static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+static constexpr size_t min_mapped_size = 2 * huge_page_size;
+
+static size_t mapped_size(size_t size) {
+  return (size + huge_page_size - 1) & ~(huge_page_size - 1);
+}
+
+void* allocate_pages(size_t size) {
+  if (size < min_mapped_size) {
+    return ::operator new(size);
+  }
+
+  // map an extra huge page, then unmap whatever is outside the aligned part
+  size = mapped_size(size);
+  void* mapped = mmap(NULL, size + huge_page_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) {
+    throw bad_alloc();
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+  uintptr_t aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+  if (aligned > start) {
+    munmap(mapped, aligned - start);
+  }
+  munmap(reinterpret_cast<void*>(aligned + size),
+      start + huge_page_size - aligned);
+  void* ret = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+  // this fails harmlessly if huge pages are disabled
+  madvise(ret, size, MADV_HUGEPAGE);
+#endif
+  return ret;
+}
+
+void free_pages(void* ptr, size_t size) {
+  if (size < min_mapped_size) {
+    ::operator delete(ptr);
+  } else {
+    munmap(ptr, mapped_size(size));
+  }
+}
+
+
+ResultBuffer::ResultBuffer() : w(0), h(0), bit_width(8), max_depth(0xFF) { }
+
+ResultBuffer::ResultBuffer(size_t w, size_t h, size_t bit_width) : w(w), h(h),
+    bit_width(bit_width), roots(w * h, 0) {
+  switch (bit_width) {
+    case 8:
+      this->depths8.resize(w * h, 0);
+      break;
+    case 16:
+      this->depths16.resize(w * h, 0);
+      break;
+    case 32:
+      this->depths32.resize(w * h, 0);
+      break;
+    case 64:
+      this->depths64.resize(w * h, 0);
+      break;
+    default:
+      throw invalid_argument("bit width must be 8, 16, 32, or 64");
+  }
+  this->max_depth = (bit_width == 64) ? UINT64_MAX : ((1ULL << bit_width) - 1);
+}
+
+
+
+ResultBufferPool::ResultBufferPool(size_t max_size) : max_size(max_size) { }
+
+ResultBuffer ResultBufferPool::take(size_t w, size_t h, size_t bit_width) {
+  {
+    lock_guard<mutex> g(this->lock);
+    for (auto it = this->buffers.begin(); it != this->buffers.end(); it++) {
+      if ((it->get_width() == w) && (it->get_height() == h) &&
+          (it->get_bit_width() == bit_width)) {
+        ResultBuffer ret = move(*it);
+        this->buffers.erase(it);
+        return ret;
+      }
+    }
+  }
+  return ResultBuffer(w, h, bit_width);
+}
+
+void ResultBufferPool::put(ResultBuffer&& buf) {
+  if (!buf.get_width() || !buf.get_height()) {
+    return;
+  }
+  lock_guard<mutex> g(this->lock);
+  if (this->buffers.size() < this->max_size) {
+    this->buffers.emplace_back(move(buf));
+  } else {
+    buf = ResultBuffer();
+  }
+}
+
+size_t ResultBufferPool::size() const {
+  lock_guard<mutex> g(this->lock);
+  return this->buffers.size();
+}
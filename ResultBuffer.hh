@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+
+// allocates memory for large arrays (e.g. frame buffers). allocations of at
+// least a few megabytes are mapped directly and aligned to 2MB, and are
+// marked to use huge pages if the system supports them, which makes faulting
+// them in and accessing them faster. smaller ones come from operator new
+void* allocate_pages(size_t size);
+void free_pages(void* ptr, size_t size);
+
+// an allocator for std::vector that uses allocate_pages
+template <typename T>
+struct PageAllocator {
+  using value_type = T;
+
+  PageAllocator() = default;
+  template <typename U>
+  PageAllocator(const PageAllocator<U>&) { }
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocate_pages(n * sizeof(T)));
+  }
+  void deallocate(T* ptr, size_t n) {
+    free_pages(ptr, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const PageAllocator<U>&) const {
+    return true;
+  }
+};
+
+// The per-pixel results of rendering a frame: how many iterations each pixel
+// took (its depth) and which root it reached. These are stored as two separate
+// planes in row order. Depths are bit_width bits (8, 16, 32 or 64) and are
+// clamped to the largest value that fits; root indexes are one byte,
+// ERROR_ROOT marks pixels that didn't reach any root, and CYCLE_ROOT marks
+// pixels that were caught in an attracting cycle instead. Both of these have
+// depth 0.
+class ResultBuffer {
+public:
+  static constexpr uint8_t ERROR_ROOT = 0xFF;
+  static constexpr uint8_t CYCLE_ROOT = 0xFE;
+  static constexpr size_t MAX_ROOTS = CYCLE_ROOT;
+
+  // returns false for ERROR_ROOT and CYCLE_ROOT
+  static inline bool is_root_index(uint8_t root) {
+    return root < MAX_ROOTS;
+  }
+
+  ResultBuffer();
+  ResultBuffer(size_t w, size_t h, size_t bit_width);
+
+  inline size_t get_width() const {
+    return this->w;
+  }
+  inline size_t get_height() const {
+    return this->h;
+  }
+  inline size_t get_bit_width() const {
+    return this->bit_width;
+  }
+  inline uint64_t get_max_depth() const {
+    return this->max_depth;
+  }
+
+  inline uint64_t get_depth(size_t x, size_t y) const {
+    size_t index = y * this->w + x;
+    switch (this->bit_width) {
+      case 8:
+        return this->depths8[index];
+      case 16:
+        return this->depths16[index];
+      case 32:
+        return this->depths32[index];
+      default:
+        return this->depths64[index];
+    }
+  }
+  inline uint8_t get_root(size_t x, size_t y) const {
+    return this->roots[y * this->w + x];
+  }
+
+  inline void set(size_t x, size_t y, uint64_t depth, uint8_t root) {
+    size_t index = y * this->w + x;
+    depth = (depth > this->max_depth) ? this->max_depth : depth;
+    switch (this->bit_width) {
+      case 8:
+        this->depths8[index] = depth;
+        break;
+      case 16:
+        this->depths16[index] = depth;
+        break;
+      case 32:
+        this->depths32[index] = depth;
+        break;
+      default:
+        this->depths64[index] = depth;
+    }
+    this->roots[index] = root;
+  }
+  inline void set_root(size_t x, size_t y, uint8_t root) {
+    this->roots[y * this->w + x] = root;
+  }
+
+  // the root plane, w * h bytes in row order
+  inline const uint8_t* get_roots() const {
+    return this->roots.data();
+  }
+  inline uint8_t* get_roots() {
+    return this->roots.data();
+  }
+
+  // calls fn with a pointer to the depth plane (w * h values in row order),
+  // which is a uint8_t*, uint16_t*, uint32_t* or uint64_t* depending on the
+  // bit width. this is for loops over many pixels, so they can be compiled
+  // once for each width instead of checking the width for every pixel
+  template <typename FnT>
+  decltype(auto) visit_depths(FnT&& fn) const {
+    switch (this->bit_width) {
+      case 8:
+        return fn(this->depths8.data());
+      case 16:
+        return fn(this->depths16.data());
+      case 32:
+        return fn(this->depths32.data());
+      default:
+        return fn(this->depths64.data());
+    }
+  }
+  template <typename FnT>
+  decltype(auto) visit_depths(FnT&& fn) {
+    switch (this->bit_width) {
+      case 8:
+        return fn(this->depths8.data());
+      case 16:
+        return fn(this->depths16.data());
+      case 32:
+        return fn(this->depths32.data());
+      default:
+        return fn(this->depths64.data());
+    }
+  }
+
+private:
+  size_t w, h, bit_width;
+  uint64_t max_depth;
+  // only the one matching bit_width is used
+  std::vector<uint8_t, PageAllocator<uint8_t>> depths8;
+  std::vector<uint16_t, PageAllocator<uint16_t>> depths16;
+  std::vector<uint32_t, PageAllocator<uint32_t>> depths32;
+  std::vector<uint64_t, PageAllocator<uint64_t>> depths64;
+  std::vector<uint8_t, PageAllocator<uint8_t>> roots;
+};
+
+// Extra samples for some of a frame's pixels, which are blended together to
+// color those pixels (see FractalParameters::supersample). pixels[z] is the
+// position (y * w + x) of a pixel, and row z of samples has its samples, in
+// row order within the pixel; the first one is at the same place as the pixel
+// itself. pixels is in increasing order.
+struct Supersamples {
+  std::vector<uint64_t> pixels;
+  ResultBuffer samples;
+};
+
+// Keeps the buffers of frames that are no longer needed, so later frames of
+// the same size can use them instead of allocating and faulting in new ones.
+// At most max_size buffers are kept; more than that are freed.
+class ResultBufferPool {
+public:
+  explicit ResultBufferPool(size_t max_size);
+
+  // returns a buffer of this size, which is one from the pool if there is one
+  // (in which case its contents are whatever the previous frame left there)
+  ResultBuffer take(size_t w, size_t h, size_t bit_width);
+  void put(ResultBuffer&& buf);
+
+  size_t size() const;
+
+private:
+  size_t max_size;
+  std::vector<ResultBuffer> buffers;
+  mutable std::mutex lock;
+};
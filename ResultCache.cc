@@ -0,0 +1,275 @@
+#include "ResultCache.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+using namespace std;
+
+
+// 'ZRTCACH3'; the low byte is the format version, so files in an older format
+// are treated as missing. the key includes it too
+static constexpr uint64_t cache_file_magic = 0x5A52544341434833;
+static_assert(sizeof(ssize_t) == sizeof(int64_t), "root colors must be 64-bit");
+
+struct CacheFileHeader {
+  uint64_t magic;
+  uint64_t key;
+  uint64_t w;
+  uint64_t h;
+  uint64_t bit_width;
+  uint64_t root_count;
+  uint64_t root_color_count;
+  // the number of supersampled pixels, and the number of samples for each
+  uint64_t supersampled_count;
+  uint64_t samples_per_pixel;
+};
+
+// computes the size of a cache file with this header in *size, or returns
+// false if it doesn't fit in a size_t (the header may come from a corrupt file)
+static bool cache_file_size(const CacheFileHeader& header, size_t* size) {
+  size_t total = sizeof(CacheFileHeader);
+  auto add = [&](uint64_t count, uint64_t item_size) -> bool {
+    size_t bytes;
+    return !__builtin_mul_overflow(count, item_size, &bytes) &&
+        !__builtin_add_overflow(total, bytes, &total);
+  };
+  // each pixel and each sample has a depth and a root index
+  size_t pixels, samples;
+  if (__builtin_mul_overflow(header.w, header.h, &pixels) ||
+      __builtin_mul_overflow(header.supersampled_count,
+          header.samples_per_pixel, &samples) ||
+      !add(header.root_count, sizeof(complex)) ||
+      !add(header.root_color_count, sizeof(int64_t)) ||
+      !add(pixels, header.bit_width / 8 + 1) ||
+      !add(header.supersampled_count, sizeof(uint64_t)) ||
+      !add(samples, header.bit_width / 8 + 1)) {
+    return false;
+  }
+  *size = total;
+  return true;
+}
+
+template <typename T>
+static void hash_value(uint64_t& hash, const T& v) {
+  hash = fnv1a64(&v, sizeof(T), hash);
+}
+
+template <typename T>
+static void hash_vector(uint64_t& hash, const vector<T>& v) {
+  hash_value(hash, v.size());
+  hash = fnv1a64(v.data(), v.size() * sizeof(T), hash);
+}
+
+
+ResultCache::ResultCache(const string& directory) : directory(directory) {
+  if (mkdir(this->directory.c_str(), 0755) && (errno != EEXIST)) {
+    throw runtime_error(string_printf("can\'t create cache directory %s: %s",
+        this->directory.c_str(), strerror(errno)));
+  }
+  if (!isdir(this->directory)) {
+    throw runtime_error(this->directory + " is not a directory");
+  }
+}
+
+uint64_t ResultCache::key(const FractalParameters& params) {
+  uint64_t hash = fnv1a64(&cache_file_magic, sizeof(cache_file_magic));
+  hash_vector(hash, params.coeffs);
+  hash_value(hash, params.w);
+  hash_value(hash, params.h);
+  hash_value(hash, params.xmin);
+  hash_value(hash, params.xmax);
+  hash_value(hash, params.ymin);
+  hash_value(hash, params.ymax);
+  hash_value(hash, params.xmin_low);
+  hash_value(hash, params.xmax_low);
+  hash_value(hash, params.ymin_low);
+  hash_value(hash, params.ymax_low);
+  hash_value(hash, params.precision);
+  hash_value(hash, params.detect_precision);
+  hash_value(hash, params.max_iterations);
+  hash_value(hash, params.result_bit_width);
+  hash_value(hash, params.subdivide_tolerance);
+  // mixed precision may change the depths slightly
+  hash_value<uint8_t>(hash, params.mixed_precision);
+  hash_value(hash, params.supersample);
+  hash_vector(hash, params.roots);
+  hash_vector(hash, params.root_colors);
+  return hash;
+}
+
+string ResultCache::filename(uint64_t key) const {
+  return string_printf("%s/%016" PRIX64 ".zrc", this->directory.c_str(), key);
+}
+
+string ResultCache::serialize(uint64_t key, const FractalResult& res) {
+  CacheFileHeader header;
+  header.magic = cache_file_magic;
+  header.key = key;
+  header.w = res.data.get_width();
+  header.h = res.data.get_height();
+  header.bit_width = res.data.get_bit_width();
+  header.root_count = res.roots.size();
+  header.root_color_count = res.root_colors.size();
+  const Supersamples& ss = res.supersamples;
+  header.supersampled_count = ss.pixels.size();
+  header.samples_per_pixel = ss.pixels.empty() ? 0 : ss.samples.get_width();
+  size_t pixels = header.w * header.h;
+  size_t samples = header.supersampled_count * header.samples_per_pixel;
+
+  string ret;
+  size_t size;
+  if (cache_file_size(header, &size)) {
+    ret.reserve(size);
+  }
+  ret.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  ret.append(reinterpret_cast<const char*>(res.roots.data()),
+      res.roots.size() * sizeof(complex));
+  ret.append(reinterpret_cast<const char*>(res.root_colors.data()),
+      res.root_colors.size() * sizeof(int64_t));
+  res.data.visit_depths([&](const auto* depths) {
+    ret.append(reinterpret_cast<const char*>(depths), pixels * sizeof(*depths));
+  });
+  ret.append(reinterpret_cast<const char*>(res.data.get_roots()), pixels);
+  if (samples) {
+    ret.append(reinterpret_cast<const char*>(ss.pixels.data()),
+        ss.pixels.size() * sizeof(uint64_t));
+    ss.samples.visit_depths([&](const auto* depths) {
+      ret.append(reinterpret_cast<const char*>(depths), samples * sizeof(*depths));
+    });
+    ret.append(reinterpret_cast<const char*>(ss.samples.get_roots()), samples);
+  }
+  return ret;
+}
+
+bool ResultCache::parse(uint64_t key, FractalResult& res, const void* data,
+    size_t size) {
+  if (size < sizeof(CacheFileHeader)) {
+    return false;
+  }
+  const auto* header = reinterpret_cast<const CacheFileHeader*>(data);
+  size_t expected_size;
+  bool valid = (header->magic == cache_file_magic) && (header->key == key) &&
+      (header->w <= UINT32_MAX) && (header->h <= UINT32_MAX) &&
+      (header->root_count <= ResultBuffer::MAX_ROOTS) &&
+      (header->root_color_count <= header->root_count) &&
+      ((header->bit_width == 8) || (header->bit_width == 16) ||
+       (header->bit_width == 32) || (header->bit_width == 64)) &&
+      (header->supersampled_count <= header->w * header->h) &&
+      (header->samples_per_pixel <= 0x100) &&
+      cache_file_size(*header, &expected_size) && (expected_size == size);
+  if (!valid) {
+    return false;
+  }
+
+  const uint8_t* r = reinterpret_cast<const uint8_t*>(header + 1);
+  const complex* roots = reinterpret_cast<const complex*>(r);
+  res.roots.assign(roots, roots + header->root_count);
+  r += header->root_count * sizeof(complex);
+  const int64_t* root_colors = reinterpret_cast<const int64_t*>(r);
+  res.root_colors.assign(root_colors, root_colors + header->root_color_count);
+  r += header->root_color_count * sizeof(int64_t);
+
+  size_t pixels = header->w * header->h;
+  res.data = ResultBuffer(header->w, header->h, header->bit_width);
+  res.data.visit_depths([&](auto* depths) {
+    memcpy(depths, r, pixels * sizeof(*depths));
+  });
+  r += pixels * (header->bit_width / 8);
+  memcpy(res.data.get_roots(), r, pixels);
+  r += pixels;
+
+  Supersamples& ss = res.supersamples;
+  size_t samples = header->supersampled_count * header->samples_per_pixel;
+  if (!samples) {
+    ss = Supersamples();
+    return true;
+  }
+  const uint64_t* sampled_pixels = reinterpret_cast<const uint64_t*>(r);
+  ss.pixels.assign(sampled_pixels, sampled_pixels + header->supersampled_count);
+  for (uint64_t pixel : ss.pixels) {
+    if (pixel >= pixels) {
+      return false;
+    }
+  }
+  r += header->supersampled_count * sizeof(uint64_t);
+  ss.samples = ResultBuffer(header->samples_per_pixel,
+      header->supersampled_count, header->bit_width);
+  ss.samples.visit_depths([&](auto* depths) {
+    memcpy(depths, r, samples * sizeof(*depths));
+  });
+  r += samples * (header->bit_width / 8);
+  memcpy(ss.samples.get_roots(), r, samples);
+  return true;
+}
+
+bool ResultCache::load(uint64_t key, FractalResult& res) const {
+  int fd = open(this->filename(key).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (st.st_size == 0)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  bool ret = ResultCache::parse(key, res, map, size);
+  munmap(map, size);
+  return ret;
+}
+
+void ResultCache::save(uint64_t key, const FractalResult& res) const {
+  string data = ResultCache::serialize(key, res);
+
+  // several threads may save the same frame at once, so each one writes to its
+  // own temporary file
+  string filename = this->filename(key);
+  string temp_filename = filename + ".XXXXXX";
+  int fd = mkstemp(temp_filename.data());
+  if (fd < 0) {
+    throw runtime_error(string_printf("can\'t create cache file %s: %s",
+        temp_filename.c_str(), strerror(errno)));
+  }
+  fchmod(fd, 0644); // mkstemp makes it private
+  FILE* f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(temp_filename.c_str());
+    throw runtime_error("can\'t open cache file " + temp_filename);
+  }
+  try {
+    fwritex(f, data);
+    if (fclose(f)) {
+      f = NULL;
+      throw runtime_error(string_printf("can\'t write cache file %s: %s",
+          temp_filename.c_str(), strerror(errno)));
+    }
+    f = NULL;
+    if (rename(temp_filename.c_str(), filename.c_str())) {
+      throw runtime_error(string_printf("can\'t rename cache file %s: %s",
+          temp_filename.c_str(), strerror(errno)));
+    }
+  } catch (...) {
+    if (f) {
+      fclose(f);
+    }
+    unlink(temp_filename.c_str());
+    throw;
+  }
+}
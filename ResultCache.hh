@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "JuliaSet.hh"
+
+
+// Stores finished frames on disk, so an interrupted render can pick up where it
+// left off, and so frames can be colored again (e.g. with different depth
+// limits) without rendering them again. Each frame is one file in the cache
+// directory, named by its key. The file is a header (CacheFileHeader in
+// ResultCache.cc), then the roots (two doubles each), the root colors (int64
+// each), the depth plane and the root plane, then the supersampled pixels'
+// positions (uint64 each) and their samples' depth and root planes (if there
+// are any), with no padding, so each part can be used directly from a mapped
+// file. Files are written under a temporary
+// name and renamed when complete, so a crash never leaves a partial entry.
+class ResultCache {
+public:
+  // creates the directory if it doesn't exist
+  explicit ResultCache(const std::string& directory);
+
+  // returns a hash of everything in params that affects the finished frame.
+  // progressive_step is not included, since the finished frame doesn't
+  // depend on it
+  static uint64_t key(const FractalParameters& params);
+
+  // returns true and fills in res if there's a valid entry for key. files that
+  // are damaged or don't match are ignored (and will be overwritten)
+  bool load(uint64_t key, FractalResult& res) const;
+  void save(uint64_t key, const FractalResult& res) const;
+
+  // converts a frame to and from the cache file format, e.g. for sending it
+  // to another process. parse returns false if the data isn't valid or
+  // doesn't match key
+  static std::string serialize(uint64_t key, const FractalResult& res);
+  static bool parse(uint64_t key, FractalResult& res, const void* data,
+      size_t size);
+
+private:
+  std::string directory;
+
+  std::string filename(uint64_t key) const;
+};
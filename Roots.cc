@@ -0,0 +1,267 @@
+#include "Roots.hh"
+
+#include <math.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+
+// returns an upper bound on the magnitude of the roots (the Cauchy bound)
+static double root_bound(const Polynomial& poly) {
+  const auto& coeffs = poly.get_coeffs();
+  double max_ratio = 0.0;
+  for (size_t x = 1; x < coeffs.size(); x++) {
+    max_ratio = max(max_ratio, sqrt((coeffs[x] / coeffs[0]).abs2()));
+  }
+  return 1.0 + max_ratio;
+}
+
+vector<complex> find_roots(const Polynomial& poly) {
+  size_t degree = poly.degree();
+  if (degree == 0) {
+    return vector<complex>();
+  }
+
+  // start with points evenly spaced on a circle that's about the size of the
+  // roots, at an angle that doesn't line up with any common symmetries
+  const auto& coeffs = poly.get_coeffs();
+  double radius = 0.0;
+  for (size_t x = 1; x <= degree; x++) {
+    double r = pow(sqrt((coeffs[x] / coeffs[0]).abs2()), 1.0 / x);
+    radius = max(radius, r);
+  }
+  if (radius == 0.0) {
+    radius = 1.0;
+  }
+  vector<complex> roots;
+  for (size_t x = 0; x < degree; x++) {
+    double angle = (2 * M_PI * x) / degree + 0.4;
+    roots.emplace_back(radius * cos(angle), radius * sin(angle));
+  }
+
+  return find_roots(poly, move(roots));
+}
+
+vector<complex> find_roots(const Polynomial& poly, vector<complex> roots) {
+  static constexpr size_t max_iterations = 1000;
+  static constexpr double tolerance = 1e-15;
+
+  size_t degree = poly.degree();
+  if (roots.size() != degree) {
+    throw invalid_argument("incorrect number of initial root estimates");
+  }
+
+  // each step is the Newton step, corrected for the repulsion of the other
+  // root estimates so they don't all converge to the same root
+  for (size_t iteration = 0; iteration < max_iterations; iteration++) {
+    bool converged = true;
+    for (size_t x = 0; x < degree; x++) {
+      complex newton_step = poly.step(roots[x]);
+      complex repulsion;
+      for (size_t y = 0; y < degree; y++) {
+        if (y != x) {
+          repulsion += complex(1, 0) / (roots[x] - roots[y]);
+        }
+      }
+      complex correction = newton_step / (complex(1, 0) - newton_step * repulsion);
+      if (!isfinite(correction.real) || !isfinite(correction.imag)) {
+        // this estimate landed exactly on a root (so p'(z) or the repulsion
+        // term may be degenerate); leave it alone
+        continue;
+      }
+      roots[x] -= correction;
+      if (correction.abs2() > tolerance * tolerance * max(1.0, roots[x].abs2())) {
+        converged = false;
+      }
+    }
+    if (converged) {
+      break;
+    }
+  }
+
+  return roots;
+}
+
+
+
+void RootTracker::update(const vector<complex>& new_coeffs) {
+  // steps never get smaller than this fraction of the way between frames
+  static constexpr double min_step = 1.0 / 1024;
+
+  if (this->coeffs.empty()) {
+    this->coeffs = new_coeffs;
+    this->roots = find_roots(Polynomial(new_coeffs));
+    for (size_t x = 0; x < this->roots.size(); x++) {
+      this->ids.emplace_back(x);
+    }
+    return;
+  }
+  if (new_coeffs == this->coeffs) {
+    return; // e.g. a keyframe hold; the roots are the same as before
+  }
+
+  // line up the coefficients by padding the shorter one with leading zeros
+  vector<complex> from = this->coeffs, to = new_coeffs;
+  if (from.size() < to.size()) {
+    from.insert(from.begin(), to.size() - from.size(), complex());
+  } else if (to.size() < from.size()) {
+    to.insert(to.begin(), from.size() - to.size(), complex());
+  }
+
+  double t = 0.0, step = 1.0;
+  while (t < 1.0) {
+    double next_t = min(t + step, 1.0);
+    vector<complex> step_coeffs;
+    for (size_t x = 0; x < from.size(); x++) {
+      step_coeffs.emplace_back(from[x] * (1.0 - next_t) + to[x] * next_t);
+    }
+    Polynomial poly(step_coeffs);
+    size_t degree = poly.degree();
+
+    // if the degree went down, drop the roots farthest from the origin (they
+    // were going to infinity); if it went up, the new roots start out far
+    // away, beyond all the existing roots
+    vector<complex> estimates = this->roots;
+    vector<size_t> estimate_ids = this->ids;
+    while (estimates.size() > degree) {
+      size_t farthest = 0;
+      for (size_t x = 1; x < estimates.size(); x++) {
+        if (estimates[x].abs2() > estimates[farthest].abs2()) {
+          farthest = x;
+        }
+      }
+      estimates.erase(estimates.begin() + farthest);
+      estimate_ids.erase(estimate_ids.begin() + farthest);
+    }
+    size_t existing_count = estimates.size();
+    if (existing_count < degree) {
+      double radius = 2 * root_bound(poly);
+      for (size_t x = existing_count; x < degree; x++) {
+        double angle = (2 * M_PI * x) / degree + 0.4;
+        estimates.emplace_back(radius * cos(angle), radius * sin(angle));
+        size_t id = 0;
+        while (find(estimate_ids.begin(), estimate_ids.end(), id) != estimate_ids.end()) {
+          id++;
+        }
+        estimate_ids.emplace_back(id);
+      }
+    }
+
+    vector<complex> new_roots = find_roots(poly, estimates);
+
+    // if any existing root moved more than a third of the way to the nearest
+    // other root, it may have swapped places with that root; try again with
+    // a smaller step
+    bool accept = true;
+    for (size_t x = 0; accept && (x < existing_count); x++) {
+      double min_distance2 = INFINITY;
+      for (size_t y = 0; y < existing_count; y++) {
+        if (y != x) {
+          min_distance2 = min(min_distance2, (estimates[y] - estimates[x]).abs2());
+        }
+      }
+      accept = ((new_roots[x] - estimates[x]).abs2() * 9 <= min_distance2);
+    }
+    if (!accept && (step > min_step)) {
+      step /= 2;
+      continue;
+    }
+
+    this->roots = move(new_roots);
+    this->ids = move(estimate_ids);
+    t = next_t;
+    step = min(step * 2, 1.0);
+  }
+
+  this->coeffs = new_coeffs;
+}
+
+// computes p'(z), p''(z) / 2 and p'''(z) / 6 (the Taylor coefficients of p
+// around z) by repeatedly dividing p by (x - z)
+static void taylor_coeffs(const Polynomial& poly, const complex& z,
+    complex* p1, complex* p2, complex* p3) {
+  vector<complex> coeffs = poly.get_coeffs();
+  complex* outputs[3] = {p1, p2, p3};
+  for (size_t k = 0; k < 4; k++) {
+    // the last coefficient of the quotient is the remainder
+    for (size_t x = 1; x + k < coeffs.size(); x++) {
+      coeffs[x] = coeffs[x - 1] * z + coeffs[x];
+    }
+    if (k > 0) {
+      *outputs[k - 1] = (k < coeffs.size()) ? coeffs[coeffs.size() - 1 - k] : complex();
+    }
+  }
+}
+
+RootSet::RootSet(const Polynomial& poly, const vector<complex>& all_roots,
+    double detect_precision) :
+    detect_precision(detect_precision), max_radius2(0.0) {
+  size_t degree = all_roots.size();
+
+  vector<double> radius2, rate2, rate3;
+  for (size_t x = 0; x < all_roots.size(); x++) {
+    const complex& root = all_roots[x];
+    if (this->find(root) >= 0) {
+      continue;
+    }
+
+    bool repeated = false;
+    double min_distance2 = INFINITY;
+    for (size_t y = 0; y < all_roots.size(); y++) {
+      if (y == x) {
+        continue;
+      }
+      if (all_roots[y].equal(root, detect_precision)) {
+        repeated = true;
+      }
+      min_distance2 = min(min_distance2, (all_roots[y] - root).abs2());
+    }
+
+    double r2 = 0.0;
+    if (!repeated) {
+      // (D / 2d)^2; if this is the only root, Newton's method converges to it
+      // from anywhere, but a disk that big doesn't help anything
+      r2 = isfinite(min_distance2)
+          ? (min_distance2 / (4 * degree * degree)) : 0.0;
+    }
+    this->roots.emplace_back(root);
+    radius2.emplace_back(r2);
+    complex p1, p2, p3;
+    taylor_coeffs(poly, root, &p1, &p2, &p3);
+    double p1_abs = sqrt(p1.abs2());
+    rate2.emplace_back(repeated ? 0.0 : (sqrt(p2.abs2()) / p1_abs));
+    rate3.emplace_back(repeated ? 0.0 : (2 * sqrt(p3.abs2()) / p1_abs));
+    this->max_radius2 = max(this->max_radius2, r2);
+  }
+
+  for (const auto& root : this->roots) {
+    this->split_data.emplace_back(root.real);
+  }
+  for (const auto& root : this->roots) {
+    this->split_data.emplace_back(root.imag);
+  }
+  this->split_data.insert(this->split_data.end(), radius2.begin(), radius2.end());
+  this->split_data.insert(this->split_data.end(), rate2.begin(), rate2.end());
+  this->split_data.insert(this->split_data.end(), rate3.begin(), rate3.end());
+}
+
+RootSet::RootSet(const Polynomial& poly, double detect_precision) :
+    RootSet(poly, find_roots(poly), detect_precision) { }
+
+ssize_t RootSet::find(const complex& z) const {
+  for (size_t x = 0; x < this->roots.size(); x++) {
+    if (this->roots[x].equal(z, this->detect_precision)) {
+      return x;
+    }
+  }
+  return -1;
+}
+
+SplitRoots RootSet::split() const {
+  size_t count = this->roots.size();
+  const double* data = this->split_data.data();
+  return {data, data + count, data + 2 * count, data + 3 * count,
+      data + 4 * count, count, this->max_radius2, this->detect_precision};
+}
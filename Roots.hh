@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "Complex.hh"
+#include "Polynomial.hh"
+
+
+// Finds all the roots of a polynomial (repeated roots are returned multiple
+// times) using the Aberth-Ehrlich method. If initial_roots is given, it must
+// have one estimate for each root (poly.degree() of them); each returned root
+// is the one that the estimate at the same index converged to.
+std::vector<complex> find_roots(const Polynomial& poly);
+std::vector<complex> find_roots(const Polynomial& poly,
+    std::vector<complex> initial_roots);
+
+// Follows the roots of a polynomial as its coefficients change from one video
+// frame to the next, so each root keeps the same id for as long as it exists.
+// Between two frames, the coefficients are moved from one frame's to the
+// other's in small enough steps that no root moves far compared to the
+// distance to its neighbors, and each step uses the previous step's roots as
+// its initial estimates. When the degree goes up (the leading coefficient
+// becomes nonzero), the new roots come in from far away and get the smallest
+// ids that aren't in use; when it goes down, the roots that were heading off
+// to infinity are dropped.
+class RootTracker {
+public:
+  RootTracker() = default;
+
+  // moves to the polynomial with these coefficients
+  void update(const std::vector<complex>& coeffs);
+
+  inline const std::vector<complex>& get_roots() const {
+    return this->roots;
+  }
+  // ids[x] is the id of roots[x]
+  inline const std::vector<size_t>& get_ids() const {
+    return this->ids;
+  }
+
+private:
+  std::vector<complex> coeffs;
+  std::vector<complex> roots;
+  std::vector<size_t> ids;
+};
+
+// The roots of a RootSet as separate arrays, as used by the vector kernels.
+// radius2[x] is the square of the radius of the convergence disk around root x,
+// and rate2[x] and rate3[x] describe how fast points in that disk converge (see
+// RootSet).
+struct SplitRoots {
+  const double* real;
+  const double* imag;
+  const double* radius2;
+  const double* rate2;
+  const double* rate3;
+  size_t count;
+  double max_radius2;
+  double detect_precision;
+};
+
+// The distinct roots of a polynomial, each with a disk around it inside which
+// Newton's method is guaranteed to converge to that root. For a simple root r
+// of a degree-d polynomial whose nearest other root is at distance D, this is
+// the disk of radius D / 2d: for any z in it, the distance from the next
+// Newton step to r is at most (d - 1) / d times |z - r|, so the point stays in
+// the disk and approaches r (this follows from p'/p being the sum of
+// 1 / (z - r) over all the roots). This bound is loose; the convergence soon
+// becomes quadratic, as described below. Repeated roots get no disk, since
+// Newton's method converges to them only linearly.
+//
+// Inside a disk, the error roughly squares on each step: if z is e away from
+// root r, the next step is about rate2 * e^2 + rate3 * e^3 away, where rate2 is
+// |p''(r) / 2p'(r)| and rate3 is |p'''(r) / 3p'(r)| (the cubic term matters
+// when p''(r) is zero). This is used to predict how many more steps a point in
+// a disk would take to converge, so points can stop at the disk's edge but
+// still report about the same depth as if they had iterated all the way.
+class RootSet {
+public:
+  RootSet() = default;
+  // all_roots are the roots of poly (e.g. from find_roots). roots closer
+  // together than detect_precision are considered the same root.
+  RootSet(const Polynomial& poly, const std::vector<complex>& all_roots,
+      double detect_precision);
+  RootSet(const Polynomial& poly, double detect_precision);
+
+  inline const std::vector<complex>& get_roots() const {
+    return this->roots;
+  }
+  inline size_t size() const {
+    return this->roots.size();
+  }
+
+  // returns the index of the root within detect_precision of z, or -1
+  ssize_t find(const complex& z) const;
+
+  SplitRoots split() const;
+
+private:
+  std::vector<complex> roots;
+  double detect_precision = 0.0;
+  double max_radius2 = 0.0;
+  std::vector<double> split_data;
+};
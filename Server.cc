@@ -0,0 +1,382 @@
+#include "Server.hh"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "Distributed.hh"
+#include "Polynomial.hh"
+#include "ResultCache.hh"
+#include "Roots.hh"
+
+using namespace std;
+
+
+// how many levels (factors of 2 in the spacing) finer or coarser than a
+// missing tile to look for cached tiles to make it from
+static constexpr size_t max_reuse_levels = 3;
+
+// the width and height of each tile. must be a multiple of 2^max_reuse_levels,
+// so the grids at spacings that differ by up to that factor line up at tile
+// edges
+static constexpr int64_t tile_size = 64;
+static_assert(tile_size % (1 << max_reuse_levels) == 0,
+    "tiles must be divisible at every reuse level");
+
+// how far (as a fraction of the pixel spacing) a view's corner may be from a
+// grid point and still be considered on it
+static constexpr double grid_tolerance = 1e-3;
+
+static int64_t floor_div(int64_t a, int64_t b) {
+  return (a >= 0) ? (a / b) : -((-a + b - 1) / b);
+}
+
+// the spacing is computed from the view's bounds, which may differ in the
+// last few bits after panning. rounding them off makes the same spacing give
+// the same tiles, and doubling the spacing still doubles the result
+static double canonical_spacing(double s) {
+  int exponent;
+  double mantissa = frexp(s, &exponent);
+  return ldexp(round(ldexp(mantissa, 40)), exponent - 40);
+}
+
+static FractalParameters tile_parameters(const FractalParameters& params,
+    double xs, double ys, int64_t i, int64_t j) {
+  FractalParameters ret = params;
+  ret.w = tile_size;
+  ret.h = tile_size;
+  ret.xmin = (i * tile_size) * xs;
+  ret.xmax = ((i + 1) * tile_size) * xs;
+  ret.ymin = (j * tile_size) * ys;
+  ret.ymax = ((j + 1) * tile_size) * ys;
+  ret.xmin_low = 0.0;
+  ret.xmax_low = 0.0;
+  ret.ymin_low = 0.0;
+  ret.ymax_low = 0.0;
+  ret.progressive_step = 0;
+  ret.supersample = 1;
+  return ret;
+}
+
+static size_t tile_memory_size(const FractalResult& tile) {
+  const auto& data = tile.data;
+  return sizeof(tile) + data.get_width() * data.get_height() *
+      (data.get_bit_width() / 8 + 1) + tile.roots.size() * sizeof(complex) +
+      tile.root_colors.size() * sizeof(ssize_t);
+}
+
+// makes a tile from the four tiles at half its spacing that cover it, by
+// taking every other pixel in every other row. children[b][a] is tile
+// (2i + a, 2j + b) at the finer spacing
+static shared_ptr<const FractalResult> merge_child_tiles(
+    const shared_ptr<const FractalResult> children[2][2]) {
+  const auto& first = *children[0][0];
+  auto ret = make_shared<FractalResult>();
+  ret->roots = first.roots;
+  ret->root_colors = first.root_colors;
+  ret->data = ResultBuffer(tile_size, tile_size, first.data.get_bit_width());
+  for (int64_t y = 0; y < tile_size; y++) {
+    for (int64_t x = 0; x < tile_size; x++) {
+      const auto& child = children[(2 * y) / tile_size][(2 * x) / tile_size]->data;
+      size_t cx = (2 * x) % tile_size, cy = (2 * y) % tile_size;
+      ret->data.set(x, y, child.get_depth(cx, cy), child.get_root(cx, cy));
+    }
+  }
+  return ret;
+}
+
+// renders tile (i, j). if ancestor (the tile at step times the spacing that
+// covers it, where step is a power of 2) is given, the pixels whose
+// coordinates are both multiples of step are copied from it, and only the
+// rest are computed
+static shared_ptr<const FractalResult> render_tile(
+    const FractalParameters& tile_params, int64_t i, int64_t j,
+    shared_ptr<const FractalResult> ancestor, int64_t step) {
+  if (!ancestor) {
+    FractalFrame frame(tile_params);
+    frame.render_rows(0, frame.rendered_height());
+    frame.fill_symmetric();
+    return make_shared<const FractalResult>(frame.finish());
+  }
+
+  // pixel (step * x, step * y) here is the fine grid's pixel
+  // (i * T + step * x, j * T + step * y), which is the coarse grid's pixel
+  // (i * T / step + x, j * T / step + y)
+  ResultBuffer data(tile_size, tile_size, tile_params.result_bit_width);
+  int64_t cells = tile_size / step;
+  int64_t px0 = i * cells - floor_div(i, step) * tile_size;
+  int64_t py0 = j * cells - floor_div(j, step) * tile_size;
+  for (int64_t y = 0; y < cells; y++) {
+    for (int64_t x = 0; x < cells; x++) {
+      data.set(step * x, step * y, ancestor->data.get_depth(px0 + x, py0 + y),
+          ancestor->data.get_root(px0 + x, py0 + y));
+    }
+  }
+
+  // these are the remaining passes of a progressive render whose first pass
+  // was copied from the ancestor
+  FractalParameters params = tile_params;
+  params.progressive_step = step;
+  FractalFrame frame(params, move(data));
+  for (int64_t pass_step = step / 2; pass_step > 0; pass_step /= 2) {
+    frame.render_pass_rows(pass_step, 0, frame.rendered_height());
+  }
+  frame.fill_symmetric();
+  return make_shared<const FractalResult>(frame.finish());
+}
+
+
+
+TileServer::TileServer(size_t thread_count, size_t cache_bytes) :
+    pool(thread_count), cache_bytes(0), max_cache_bytes(cache_bytes) { }
+
+shared_ptr<const FractalResult> TileServer::find_tile(uint64_t key) {
+  lock_guard<mutex> g(this->cache_lock);
+  auto it = this->cache_index.find(key);
+  if (it == this->cache_index.end()) {
+    return nullptr;
+  }
+  this->cache_entries.splice(this->cache_entries.begin(), this->cache_entries,
+      it->second);
+  return it->second->tile;
+}
+
+void TileServer::add_tile(uint64_t key, shared_ptr<const FractalResult> tile) {
+  lock_guard<mutex> g(this->cache_lock);
+  if (this->cache_index.count(key)) {
+    return;
+  }
+  size_t size = tile_memory_size(*tile);
+  this->cache_entries.emplace_front(CacheEntry{key, move(tile), size});
+  this->cache_index.emplace(key, this->cache_entries.begin());
+  this->cache_bytes += size;
+
+  // the new tile is never dropped, even if it's bigger than the whole cache,
+  // since it's about to be used
+  while ((this->cache_bytes > this->max_cache_bytes) &&
+      (this->cache_entries.size() > 1)) {
+    const auto& entry = this->cache_entries.back();
+    this->cache_bytes -= entry.size;
+    this->cache_index.erase(entry.key);
+    this->cache_entries.pop_back();
+  }
+}
+
+shared_ptr<const FractalResult> TileServer::merge_finer_tiles(
+    const FractalParameters& params, double xs, double ys, int64_t i,
+    int64_t j, size_t levels) {
+  shared_ptr<const FractalResult> children[2][2];
+  for (int64_t b = 0; b < 2; b++) {
+    for (int64_t a = 0; a < 2; a++) {
+      auto& child = children[b][a];
+      child = this->find_tile(ResultCache::key(tile_parameters(
+          params, xs / 2, ys / 2, 2 * i + a, 2 * j + b)));
+      if (!child && (levels > 1)) {
+        child = this->merge_finer_tiles(params, xs / 2, ys / 2, 2 * i + a,
+            2 * j + b, levels - 1);
+      }
+      if (!child) {
+        return nullptr;
+      }
+    }
+  }
+
+  auto ret = merge_child_tiles(children);
+  this->add_tile(ResultCache::key(tile_parameters(params, xs, ys, i, j)), ret);
+  return ret;
+}
+
+FractalResult TileServer::render(const FractalParameters& request) {
+  auto start_time = chrono::steady_clock::now();
+
+  FractalParameters params = request;
+  params.progressive_step = 0;
+  if (params.roots.empty()) {
+    params.roots = find_roots(Polynomial(params.coeffs));
+    params.root_colors.resize(params.roots.size());
+    for (size_t x = 0; x < params.roots.size(); x++) {
+      params.root_colors[x] = x;
+    }
+  }
+
+  double xs = canonical_spacing((params.xmax - params.xmin) / params.w);
+  double ys = canonical_spacing((params.ymax - params.ymin) / params.h);
+  int64_t gx0 = 0, gy0 = 0;
+  bool use_tiles = (params.w > 0) && (params.h > 0) &&
+      isfinite(xs) && isfinite(ys) && (xs != 0.0) && (ys != 0.0) &&
+      (params.supersample <= 1) && !window_needs_double_double(params) &&
+      (params.xmin_low == 0.0) && (params.xmax_low == 0.0) &&
+      (params.ymin_low == 0.0) && (params.ymax_low == 0.0);
+  if (use_tiles) {
+    gx0 = llround(params.xmin / xs);
+    gy0 = llround(params.ymin / ys);
+    use_tiles = (fabs(params.xmin - gx0 * xs) <= grid_tolerance * fabs(xs)) &&
+        (fabs(params.ymin - gy0 * ys) <= grid_tolerance * fabs(ys));
+  }
+  if (!use_tiles) {
+    RenderOptions options;
+    options.pool = &this->pool;
+    FractalResult ret = julia_fractal(params, options);
+    fprintf(stderr, "%zux%zu view: not on the tile grid; rendered in %" PRId64 " ms\n",
+        params.w, params.h, static_cast<int64_t>(
+          chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - start_time).count()));
+    return ret;
+  }
+
+  int64_t i0 = floor_div(gx0, tile_size);
+  int64_t j0 = floor_div(gy0, tile_size);
+  int64_t i1 = floor_div(gx0 + params.w - 1, tile_size) + 1;
+  int64_t j1 = floor_div(gy0 + params.h - 1, tile_size) + 1;
+  size_t tiles_w = i1 - i0, tiles_h = j1 - j0;
+
+  // find the tiles that are already cached or can be made from cached tiles,
+  // and render the rest in parallel
+  vector<shared_ptr<const FractalResult>> tiles(tiles_w * tiles_h);
+  vector<function<void()>> render_fns;
+  size_t cached_count = 0, finer_count = 0, coarser_count = 0;
+  for (int64_t j = j0; j < j1; j++) {
+    for (int64_t i = i0; i < i1; i++) {
+      auto& tile = tiles[(j - j0) * tiles_w + (i - i0)];
+      FractalParameters tile_params = tile_parameters(params, xs, ys, i, j);
+      uint64_t key = ResultCache::key(tile_params);
+      if ((tile = this->find_tile(key))) {
+        cached_count++;
+        continue;
+      }
+
+      if ((tile = this->merge_finer_tiles(params, xs, ys, i, j,
+          max_reuse_levels))) {
+        finer_count++;
+        continue;
+      }
+
+      // use the nearest coarser tile that's cached, since it has the most
+      // pixels in common with this one
+      shared_ptr<const FractalResult> ancestor;
+      int64_t step = 2;
+      for (size_t level = 1; level <= max_reuse_levels; level++, step *= 2) {
+        if ((ancestor = this->find_tile(ResultCache::key(tile_parameters(
+            params, xs * step, ys * step, floor_div(i, step),
+            floor_div(j, step)))))) {
+          break;
+        }
+      }
+      coarser_count += (ancestor != nullptr);
+      render_fns.emplace_back([this, &tile, tile_params, key, i, j, ancestor,
+          step]() {
+        tile = render_tile(tile_params, i, j, ancestor, step);
+        this->add_tile(key, tile);
+      });
+    }
+  }
+  size_t rendered_count = render_fns.size() - coarser_count;
+  this->pool.run_all(render_fns);
+
+  FractalResult ret;
+  ret.roots = tiles[0]->roots;
+  ret.root_colors = tiles[0]->root_colors;
+  ret.data = ResultBuffer(params.w, params.h, params.result_bit_width);
+  for (size_t y = 0; y < params.h; y++) {
+    int64_t gy = gy0 + y;
+    int64_t j = floor_div(gy, tile_size);
+    size_t ty = gy - j * tile_size;
+    for (size_t x = 0; x < params.w; x++) {
+      int64_t gx = gx0 + x;
+      int64_t i = floor_div(gx, tile_size);
+      size_t tx = gx - i * tile_size;
+      const auto& tile_data = tiles[(j - j0) * tiles_w + (i - i0)]->data;
+      ret.data.set(x, y, tile_data.get_depth(tx, ty), tile_data.get_root(tx, ty));
+    }
+  }
+
+  fprintf(stderr, "%zux%zu view: %zu tiles (%zu cached, %zu from finer tiles, "
+      "%zu from coarser tiles, %zu rendered) in %" PRId64 " ms\n",
+      params.w, params.h, tiles.size(), cached_count, finer_count,
+      coarser_count, rendered_count, static_cast<int64_t>(
+        chrono::duration_cast<chrono::milliseconds>(
+          chrono::steady_clock::now() - start_time).count()));
+  return ret;
+}
+
+
+
+static void serve_client(TileServer* server, int fd) {
+  try {
+    MessageType type;
+    string data;
+    while (receive_message(fd, type, data) && (type != MessageType::DONE)) {
+      if (type != MessageType::RENDER_FRAME) {
+        throw runtime_error(string_printf("received unexpected message type %u",
+            static_cast<uint32_t>(type)));
+      }
+
+      string response;
+      MessageType response_type;
+      try {
+        FractalParameters params = parse_parameters(data);
+        FractalResult res = server->render(params);
+        response = ResultCache::serialize(ResultCache::key(params), res);
+        response_type = MessageType::FRAME_RESULT;
+      } catch (const exception& e) {
+        response = e.what();
+        response_type = MessageType::FRAME_ERROR;
+      }
+      send_message(fd, response_type, response);
+    }
+  } catch (const exception& e) {
+    fprintf(stderr, "warning: client failed: %s\n", e.what());
+  }
+  close(fd);
+}
+
+void run_server(const string& address, size_t thread_count,
+    size_t cache_bytes) {
+  TileServer server(thread_count, cache_bytes);
+  int listen_fd = listen_socket(address);
+  fprintf(stderr, "listening at %s\n", address.c_str());
+  for (;;) {
+    int fd;
+    try {
+      fd = accept_socket(listen_fd);
+    } catch (const exception& e) {
+      fprintf(stderr, "warning: can\'t accept connection: %s\n", e.what());
+      continue;
+    }
+    // each client gets a thread until it disconnects. the server never stops,
+    // so these are never joined
+    thread(serve_client, &server, fd).detach();
+  }
+}
+
+FractalResult request_render(const string& address,
+    const FractalParameters& params) {
+  int fd = connect_socket(address);
+  try {
+    send_message(fd, MessageType::RENDER_FRAME, serialize_parameters(params));
+    MessageType type;
+    string data;
+    if (!receive_message(fd, type, data)) {
+      throw runtime_error("server closed the connection");
+    }
+    if (type == MessageType::FRAME_ERROR) {
+      throw runtime_error("server failed to render the frame: " + data);
+    }
+    FractalResult res;
+    if ((type != MessageType::FRAME_RESULT) ||
+        !ResultCache::parse(ResultCache::key(params), res, data.data(), data.size())) {
+      throw runtime_error("server sent an invalid response");
+    }
+    send_message(fd, MessageType::DONE, "");
+    close(fd);
+    return res;
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
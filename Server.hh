@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "JuliaSet.hh"
+#include "Pipeline.hh"
+
+
+// A long-running render server, for interactive programs (e.g. an explorer UI)
+// that render many views of the same fractal as the user pans and zooms.
+// Clients connect to it at an address (see Distributed.hh) and send a
+// RENDER_FRAME message for each view; the server replies to each one with
+// FRAME_RESULT or FRAME_ERROR, as a worker process does, and keeps the
+// connection open until the client sends DONE or disconnects.
+//
+// Views are put together from square tiles on a grid that's fixed in the
+// complex plane: at pixel spacing (xs, ys), tile (i, j) covers the pixels at
+// x = gx * xs for gx in [i * T, (i + 1) * T), and likewise for y. A view can
+// use the tiles if its corner is on that grid (xmin and ymin are whole
+// multiples of the spacing), which stays true when it's panned by whole pixels
+// or zoomed in or out by a factor of 2 around a pixel. Tiles are kept in an
+// in-memory cache, so panning only renders the tiles that weren't in the
+// previous views. Since the grids for spacings that differ by a factor of 2^k
+// share every 2^kth pixel, a missing tile is made from the cached finer tiles
+// that cover it, up to three levels finer (after zooming out), or rendered with
+// some of its pixels taken from the nearest cached coarser tile that covers it,
+// up to three levels coarser (after zooming in).
+//
+// Unless the request gives the roots, the views use the polynomial's roots in
+// the order find_roots returns them, so each root keeps its color from one
+// view to the next. Views that can't use the grid (their corners aren't on it,
+// they need double-double precision, or they're supersampled) are rendered
+// directly.
+class TileServer {
+public:
+  // thread_count threads (and the threads calling render) render tiles; the
+  // cache holds up to cache_bytes of tiles, dropping the least recently used
+  // ones when it's full
+  TileServer(size_t thread_count, size_t cache_bytes);
+
+  FractalResult render(const FractalParameters& params);
+
+private:
+  struct CacheEntry {
+    uint64_t key;
+    std::shared_ptr<const FractalResult> tile;
+    size_t size;
+  };
+
+  ThreadPool pool;
+
+  // most recently used first
+  std::mutex cache_lock;
+  std::list<CacheEntry> cache_entries;
+  std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> cache_index;
+  size_t cache_bytes;
+  size_t max_cache_bytes;
+
+  std::shared_ptr<const FractalResult> find_tile(uint64_t key);
+  void add_tile(uint64_t key, std::shared_ptr<const FractalResult> tile);
+  // makes tile (i, j) at spacing (xs, ys) from the four tiles at half that
+  // spacing, each of which is cached or made the same way from up to levels - 1
+  // finer levels, and caches it. returns null if any of them is missing
+  std::shared_ptr<const FractalResult> merge_finer_tiles(
+      const FractalParameters& params, double xs, double ys, int64_t i,
+      int64_t j, size_t levels);
+};
+
+// listens at address and serves clients until killed
+void run_server(const std::string& address, size_t thread_count,
+    size_t cache_bytes);
+
+// renders one view on the server at address, for a client that only needs one
+FractalResult request_render(const std::string& address,
+    const FractalParameters& params);
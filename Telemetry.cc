@@ -0,0 +1,70 @@
+#include "Telemetry.hh"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+void FrameStats::add_result(const ResultBuffer& data) {
+  this->pixel_count = data.get_width() * data.get_height();
+  this->non_converged_count = 0;
+  this->cycle_count = 0;
+  this->total_depth = 0;
+  this->depth_histogram.assign(65, 0);
+
+  const uint8_t* roots = data.get_roots();
+  data.visit_depths([&](const auto* depths) {
+    for (size_t z = 0; z < this->pixel_count; z++) {
+      if (!ResultBuffer::is_root_index(roots[z])) {
+        this->non_converged_count++;
+        this->cycle_count += (roots[z] == ResultBuffer::CYCLE_ROOT);
+      } else {
+        uint64_t depth = depths[z];
+        this->total_depth += depth;
+        this->depth_histogram[depth ? (64 - __builtin_clzll(depth)) : 0]++;
+      }
+    }
+  });
+
+  while (!this->depth_histogram.empty() && !this->depth_histogram.back()) {
+    this->depth_histogram.pop_back();
+  }
+}
+
+string FrameStats::json() const {
+  string ret = string_printf("{\"event\":\"frame\",\"frame\":%zu,"
+      "\"output_frame\":%zu,\"cached\":%s,\"remote\":%s,\"wall_ms\":%.3f,"
+      "\"cpu_ms\":%.3f,\"pixels\":%zu,\"non_converged\":%zu,\"cycles\":%zu,"
+      "\"total_depth\":%" PRIu64 ",\"depth_histogram\":[",
+      this->frame_index, this->output_frame_index,
+      this->cached ? "true" : "false", this->remote ? "true" : "false",
+      this->wall_usecs / 1000.0, this->cpu_usecs / 1000.0, this->pixel_count,
+      this->non_converged_count, this->cycle_count, this->total_depth);
+  for (size_t x = 0; x < this->depth_histogram.size(); x++) {
+    ret += string_printf(x ? ",%" PRIu64 : "%" PRIu64, this->depth_histogram[x]);
+  }
+  ret += "]}";
+  return ret;
+}
+
+bool write_line(int fd, const string& line) {
+  string data = line + "\n";
+  const char* p = data.data();
+  size_t size = data.size();
+  while (size) {
+    ssize_t bytes_written = write(fd, p, size);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += bytes_written;
+    size -= bytes_written;
+  }
+  return true;
+}
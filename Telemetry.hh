@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "ResultBuffer.hh"
+
+
+// Statistics about one finished frame, reported by --telemetry-fd as a JSON
+// object on its own line.
+struct FrameStats {
+  size_t frame_index = 0;
+  // the first output frame that this frame is written as (this differs from
+  // frame_index after a repeated frame)
+  size_t output_frame_index = 0;
+  // loaded from the cache instead of rendered
+  bool cached = false;
+  // rendered by a worker process (see Distributed.hh)
+  bool remote = false;
+  // from starting the frame to finishing it
+  uint64_t wall_usecs = 0;
+  // time spent rendering the frame, summed over all the threads that worked
+  // on it. for remote frames, this is the same as wall_usecs
+  uint64_t cpu_usecs = 0;
+
+  size_t pixel_count = 0;
+  // pixels that didn't reach a root, and those of them that were caught in
+  // cycles
+  size_t non_converged_count = 0;
+  size_t cycle_count = 0;
+  // the sum of the depths of the pixels that did
+  uint64_t total_depth = 0;
+  // depth_histogram[0] is the number of pixels (that reached a root) with
+  // depth 0, and depth_histogram[x] for x > 0 is the number with depths in
+  // [2^(x-1), 2^x). trailing zeroes are omitted
+  std::vector<uint64_t> depth_histogram;
+
+  // fills in the pixel counts, total_depth and depth_histogram
+  void add_result(const ResultBuffer& data);
+
+  std::string json() const;
+};
+
+// writes line and a newline to fd, retrying after partial writes. returns false
+// if the write failed (e.g. because the reader is gone)
+bool write_line(int fd, const std::string& line);